@@ -0,0 +1,480 @@
+#include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+// Benchmarks for the stages of the disassembler on reproducible synthetic
+// corpora. The stages are the disassembler's own functions, so it is built from
+// the same source with its main() renamed out of the way.
+#define main disassembler_main
+#include "disassembler.c"
+#undef main
+
+extern char **environ;
+
+// Random number generator (xorshift64*), so a seed always gives the same corpus
+uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// One RV32IM instruction shape for the realistic mix: the bits in `mask` are
+// taken from `match`, the rest (registers, immediates) are random
+typedef struct {
+  uint32_t match;
+  uint32_t mask;
+  uint32_t weight;
+} instruction_shape;
+
+// Rough instruction frequencies of compiled RV32IM code
+const instruction_shape mix_shapes[] = {
+  {0x00000013, 0x0000707f, 18},   // addi
+  {0x00002003, 0x0000707f, 12},   // lw
+  {0x00002023, 0x0000707f, 8},    // sw
+  {0x00004003, 0x0000707f, 2},    // lbu
+  {0x00000023, 0x0000707f, 2},    // sb
+  {0x00001003, 0x0000707f, 1},    // lh
+  {0x00001023, 0x0000707f, 1},    // sh
+  {0x00001013, 0xfe00707f, 2},    // slli
+  {0x00005013, 0xfe00707f, 2},    // srli
+  {0x40005013, 0xfe00707f, 1},    // srai
+  {0x00007013, 0x0000707f, 2},    // andi
+  {0x00006013, 0x0000707f, 1},    // ori
+  {0x00004013, 0x0000707f, 1},    // xori
+  {0x00003013, 0x0000707f, 1},    // sltiu
+  {0x00000033, 0xfe00707f, 6},    // add
+  {0x40000033, 0xfe00707f, 3},    // sub
+  {0x00007033, 0xfe00707f, 1},    // and
+  {0x00006033, 0xfe00707f, 1},    // or
+  {0x00004033, 0xfe00707f, 1},    // xor
+  {0x00001033, 0xfe00707f, 1},    // sll
+  {0x00003033, 0xfe00707f, 1},    // sltu
+  {0x02000033, 0xfe00707f, 2},    // mul
+  {0x02004033, 0xfe00707f, 1},    // div
+  {0x02007033, 0xfe00707f, 1},    // remu
+  {0x00000063, 0x0000707f, 5},    // beq
+  {0x00001063, 0x0000707f, 6},    // bne
+  {0x00004063, 0x0000707f, 2},    // blt
+  {0x00005063, 0x0000707f, 2},    // bge
+  {0x00006063, 0x0000707f, 1},    // bltu
+  {0x00007063, 0x0000707f, 1},    // bgeu
+  {0x0000006f, 0x0000007f, 5},    // jal
+  {0x00000067, 0x0000707f, 3},    // jalr
+  {0x00000037, 0x0000007f, 5},    // lui
+  {0x00000017, 0x0000007f, 3},    // auipc
+  {0x00002073, 0x0000707f, 1},    // csrrs
+};
+
+// A generated .text section with its function symbols
+typedef struct {
+  const char   *name;
+  uint32_t     *words;
+  uint32_t      count;
+  symtab_entry *symbols;       // symbols[0] is the null symbol, as in .symtab
+  uint32_t      symbol_count;
+  char         *strtab;
+  uint32_t      strtab_size;
+} corpus;
+
+#define CORPUS_ADDRESS 0x10000
+
+void free_corpus(corpus *c) {
+  free(c->words);
+  free(c->symbols);
+  free(c->strtab);
+}
+
+// Fills `c` with `count` instructions and a function symbol every `min_gap` to
+// `max_gap` instructions. With `uniform` set the words are plain random bits,
+// otherwise they follow mix_shapes.
+int generate_corpus(corpus *c, const char *name, uint32_t count, int uniform, uint32_t min_gap, uint32_t max_gap,
+                    uint64_t seed) {
+  uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+  uint32_t total_weight = 0;
+  for (size_t k = 0; k < sizeof(mix_shapes) / sizeof(mix_shapes[0]); k++) total_weight += mix_shapes[k].weight;
+
+  c->name = name;
+  c->count = count;
+  c->words = malloc(count * sizeof(uint32_t));
+  c->symbols = malloc((count / min_gap + 2) * sizeof(symtab_entry));
+  // Names are "f" and up to 10 digits
+  c->strtab = malloc((count / min_gap + 2) * 12 + 1);
+  if (!c->words || !c->symbols || !c->strtab) {
+    free_corpus(c);
+    printf("Not enough memory for the %s corpus\n", name);
+    return 0xa110c;
+  }
+
+  for (uint32_t k = 0; k < count; k++) {
+    uint32_t random = next_random(&state) >> 32;
+    if (uniform) {
+      c->words[k] = random;
+      continue;
+    }
+    uint32_t pick = next_random(&state) % total_weight;
+    const instruction_shape *shape = mix_shapes;
+    while (pick >= shape->weight) pick -= (shape++)->weight;
+    c->words[k] = shape->match | (random & ~shape->mask);
+  }
+
+  memset(&c->symbols[0], 0, sizeof(symtab_entry));
+  c->strtab[0] = 0;
+  c->strtab_size = 1;
+  c->symbol_count = 1;
+  for (uint32_t k = 0; k < count; k += min_gap + next_random(&state) % (max_gap - min_gap + 1)) {
+    symtab_entry *symbol = &c->symbols[c->symbol_count];
+    symbol->st_name = c->strtab_size;
+    symbol->st_value = CORPUS_ADDRESS + k * 4;
+    symbol->st_size = 0;
+    symbol->st_info = 0x12;           // STB_GLOBAL, STT_FUNC
+    symbol->st_other = 0;
+    symbol->st_shndx = 1;
+    c->strtab_size += sprintf(c->strtab + c->strtab_size, "f%u", c->symbol_count++) + 1;
+  }
+  return 0;
+}
+
+// Writes `c` as a minimal ELF object with .text, .symtab, .strtab and .shstrtab
+int write_corpus_elf(const corpus *c, const char *path) {
+  const char section_names[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+  uint32_t text_offset = sizeof(elf_header);
+  uint32_t symtab_offset = text_offset + c->count * 4;
+  uint32_t strtab_offset = symtab_offset + c->symbol_count * sizeof(symtab_entry);
+  uint32_t names_offset = strtab_offset + c->strtab_size;
+  uint32_t sections_offset = (names_offset + sizeof(section_names) + 3) & ~3u;
+
+  elf_header header = {
+    .e_ident = {0x7f, 'E', 'L', 'F', 1, 1, 1},
+    .e_type = 1,
+    .e_machine = 0xf3,
+    .e_version = 1,
+    .e_shoff = sections_offset,
+    .e_ehsize = sizeof(elf_header),
+    .e_shentsize = sizeof(section_header),
+    .e_shnum = 5,
+    .e_shstrndx = 4
+  };
+  section_header sections[5] = {
+    {0},
+    {.sh_name = 1,  .sh_type = 1, .sh_flags = 6, .sh_addr = CORPUS_ADDRESS, .sh_offset = text_offset,
+     .sh_size = c->count * 4, .sh_addralign = 4},
+    {.sh_name = 7,  .sh_type = 2, .sh_offset = symtab_offset, .sh_size = c->symbol_count * sizeof(symtab_entry),
+     .sh_link = 3, .sh_info = 1, .sh_addralign = 4, .sh_entsize = sizeof(symtab_entry)},
+    {.sh_name = 15, .sh_type = 3, .sh_offset = strtab_offset, .sh_size = c->strtab_size, .sh_addralign = 1},
+    {.sh_name = 23, .sh_type = 3, .sh_offset = names_offset, .sh_size = sizeof(section_names), .sh_addralign = 1}
+  };
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    printf("Cannot create %s\n", path);
+    return 0xf11e;
+  }
+  const uint8_t padding[4] = {0};
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(c->words, 4, c->count, file);
+  fwrite(c->symbols, sizeof(symtab_entry), c->symbol_count, file);
+  fwrite(c->strtab, 1, c->strtab_size, file);
+  fwrite(section_names, 1, sizeof(section_names), file);
+  fwrite(padding, 1, sections_offset - names_offset - sizeof(section_names), file);
+  fwrite(sections, sizeof(section_header), 5, file);
+  if (fclose(file) != 0) {
+    printf("Cannot write %s\n", path);
+    return 0xf11e;
+  }
+  return 0;
+}
+
+uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Results are folded into this so the compiler cannot drop the measured work
+volatile uint64_t bench_sink;
+
+uint64_t run_get_command(const corpus *c) {
+  uint64_t sum = 0;
+  uint64_t start = now_ns();
+  for (uint32_t k = 0; k < c->count; k++) sum += get_command(c->words[k]);
+  uint64_t elapsed = now_ns() - start;
+  bench_sink += sum;
+  return elapsed;
+}
+
+// get_command followed by the scalar operand and immediate extraction
+uint64_t run_fields(const corpus *c) {
+  uint64_t sum = 0;
+  uint64_t start = now_ns();
+  for (uint32_t k = 0; k < c->count; k++) {
+    uint32_t word = c->words[k];
+    enum Command cmd = get_command(word);
+    sum += get_slice(word, 11, 7) + get_slice(word, 19, 15) + get_slice(word, 24, 20) +
+           get_immediate(word, command_formats[cmd]);
+  }
+  uint64_t elapsed = now_ns() - start;
+  bench_sink += sum;
+  return elapsed;
+}
+
+// The batch decoder, in the chunks the disassembler uses
+uint64_t run_decode(const corpus *c, decoded_instructions *decoded) {
+  uint64_t sum = 0;
+  uint64_t start = now_ns();
+  for (uint32_t first = 0; first < c->count; first += CHUNK_SIZE) {
+    uint32_t count = c->count - first < CHUNK_SIZE ? c->count - first : CHUNK_SIZE;
+    decode_instructions(c->words + first, count, decoded);
+    sum += decoded->command[count - 1];
+  }
+  uint64_t elapsed = now_ns() - start;
+  bench_sink += sum;
+  return elapsed;
+}
+
+// Decoding and formatting into memory, labels included, without the write
+uint64_t run_format(const corpus *c, decoded_instructions *decoded, output_buffer *out, const label_index *labels) {
+  code_view code = {
+    .bytes = (const uint8_t *) c->words,
+    .size = c->count * 4,
+    .address = CORPUS_ADDRESS,
+    .compressed = false,
+    .section_address = CORPUS_ADDRESS,
+    .section_size = c->count * 4
+  };
+  uint64_t sum = 0;
+  uint64_t start = now_ns();
+  for (uint32_t first = 0; first < c->count; first += CHUNK_SIZE) {
+    uint32_t end = c->count - first < CHUNK_SIZE ? c->count : first + CHUNK_SIZE;
+    out->length = 0;
+    disassemble_chunk(out, decoded, &code, first * 4, end * 4, labels);
+    sum += out->length;
+  }
+  uint64_t elapsed = now_ns() - start;
+  bench_sink += sum;
+  return elapsed;
+}
+
+// One find_label() per instruction, at random addresses inside the section
+uint64_t run_labels(const corpus *c, const label_index *labels, uint64_t seed) {
+  uint64_t state = seed + 1;
+  uint64_t sum = 0;
+  uint64_t start = now_ns();
+  for (uint32_t k = 0; k < c->count; k++) {
+    sum += find_label(labels, CORPUS_ADDRESS + ((next_random(&state) >> 32) * c->count >> 32) * 4);
+  }
+  uint64_t elapsed = now_ns() - start;
+  bench_sink += sum;
+  return elapsed;
+}
+
+// The whole dis binary on the corpus written out as an ELF, output to /dev/null
+uint64_t run_end_to_end(const char *dis_path, const char *elf_path, int jobs) {
+  char jobs_text[16];
+  snprintf(jobs_text, sizeof(jobs_text), "%d", jobs);
+  char *argv[] = {(char *) dis_path, "--jobs", jobs_text, (char *) elf_path, "/dev/null", NULL};
+  uint64_t start = now_ns();
+  pid_t child;
+  if (posix_spawn(&child, dis_path, NULL, NULL, argv, environ) != 0) return 0;
+  int status;
+  if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return 0;
+  return now_ns() - start;
+}
+
+typedef struct {
+  uint32_t    size;          // instructions in the regular corpora, the large one is 16 times that
+  int         repeat;        // runs per stage, the fastest one is reported
+  uint64_t    seed;
+  const char *dis_path;      // binary for the end-to-end stage, none to skip it
+  int         jobs;          // the end-to-end stage runs with --jobs 1 up to this
+  int         json;
+} bench_options;
+
+bench_options bench = {.size = 1 << 20, .repeat = 5, .seed = 1, .dis_path = "./dis"};
+
+int results_printed = 0;
+
+// `jobs` is the thread count of the stage, 0 for the stages that run in this process on one thread
+void print_result(const corpus *c, const char *stage, int jobs, uint64_t elapsed_ns, uint64_t items) {
+  double ns_per_item = (double) elapsed_ns / items;
+  if (bench.json) {
+    printf("%s\n    {\"corpus\": \"%s\", \"stage\": \"%s\", \"jobs\": %d, \"instructions\": %u, \"symbols\": %u, "
+           "\"ns_per_instruction\": %.3f, \"instructions_per_second\": %.0f}",
+           results_printed ? "," : "", c->name, stage, jobs ? jobs : 1, c->count, c->symbol_count - 1, ns_per_item,
+           1e9 / ns_per_item);
+  } else {
+    char name[32];
+    if (jobs) {
+      snprintf(name, sizeof(name), "%s/%d", stage, jobs);
+    } else {
+      snprintf(name, sizeof(name), "%s", stage);
+    }
+    printf("%-8s %-14s %10u %8u %10.3f %10.1f\n", c->name, name, c->count, c->symbol_count - 1, ns_per_item,
+           1e3 / ns_per_item);
+  }
+  results_printed++;
+}
+
+// Runs `run` bench.repeat times and keeps the fastest, a zero time means the stage failed
+#define BEST_OF(result, run)                                        \
+  do {                                                              \
+    result = 0;                                                     \
+    for (int r = 0; r < bench.repeat; r++) {                        \
+      uint64_t elapsed = run;                                       \
+      if (elapsed == 0) { result = 0; break; }                      \
+      if (result == 0 || elapsed < result) result = elapsed;        \
+    }                                                               \
+  } while (0)
+
+int bench_corpus(corpus *c) {
+  decoded_instructions decoded;
+  output_buffer out = {0};
+  label_index labels;
+  arena memory = {0};
+  if (alloc_decoded(&decoded, CHUNK_SIZE) != 0) {
+    printf("Not enough memory for the decoded instructions\n");
+    return 0xa110c;
+  }
+  if (build_label_index(&labels, c->symbols, c->symbol_count, (const uint8_t *) c->strtab, c->strtab_size, &memory) != 0) {
+    free_decoded(&decoded);
+    printf("Not enough memory for the symbol table\n");
+    return 0xa110c;
+  }
+
+  uint64_t best;
+  BEST_OF(best, run_get_command(c));
+  print_result(c, "get_command", 0, best, c->count);
+  BEST_OF(best, run_fields(c));
+  print_result(c, "fields", 0, best, c->count);
+  BEST_OF(best, run_decode(c, &decoded));
+  print_result(c, "decode", 0, best, c->count);
+  BEST_OF(best, run_format(c, &decoded, &out, &labels));
+  print_result(c, "format", 0, best, c->count);
+  BEST_OF(best, run_labels(c, &labels, bench.seed));
+  print_result(c, "label_lookup", 0, best, c->count);
+
+  int error = out.failed ? 0xa110c : 0;
+  if (bench.dis_path[0] && error == 0) {
+    char elf_path[] = "/tmp/dis_bench_XXXXXX";
+    int fd = mkstemp(elf_path);
+    if (fd < 0) {
+      printf("Cannot create a temporary file for the %s corpus\n", c->name);
+      error = 0xf11e;
+    } else {
+      close(fd);
+      error = write_corpus_elf(c, elf_path);
+      // Scaling: the whole binary at every job count, so that throughput can be read against the cores used
+      for (int jobs = 1; error == 0 && jobs <= bench.jobs; jobs++) {
+        BEST_OF(best, run_end_to_end(bench.dis_path, elf_path, jobs));
+        if (best == 0) {
+          fprintf(stderr, "%s failed on the %s corpus\n", bench.dis_path, c->name);
+          error = 0xe2e;
+        } else {
+          print_result(c, "end_to_end", jobs, best, c->count);
+        }
+      }
+      unlink(elf_path);
+    }
+  }
+  free(out.data);
+  arena_release(&memory);
+  free_decoded(&decoded);
+  return error;
+}
+
+// hash_bytes() against known XXH64 values, as a wrong hash would only show as cache misses. The lengths cover the
+// empty input, the 1-byte and 4-byte tails, and inputs below, at and above the 32-byte stripe
+int check_hash(void) {
+  uint8_t bytes[101];
+  for (int k = 0; k < 101; k++) bytes[k] = k;
+  struct { const void *data; size_t size; uint64_t seed; uint64_t hash; } vectors[] = {
+    {"",    0,   0,          0xef46db3751d8e999ULL},
+    {"a",   1,   0,          0xd24ec4f1a98c6e5bULL},
+    {"abc", 3,   0,          0x44bc2cf5ad770999ULL},
+    {bytes, 31,  0,          0xc346d2b59b4d8ee1ULL},
+    {bytes, 32,  0,          0xcbf59c5116ff32b4ULL},
+    {bytes, 101, 0x9e3779b1, 0xa1c6d4174c37136dULL},
+  };
+  int error = 0;
+  for (size_t k = 0; k < sizeof(vectors) / sizeof(vectors[0]); k++) {
+    uint64_t hash = hash_bytes(vectors[k].data, vectors[k].size, vectors[k].seed);
+    if (hash != vectors[k].hash) {
+      fprintf(stderr, "hash_bytes of %zu bytes is %016llx instead of %016llx\n", vectors[k].size,
+              (unsigned long long) hash, (unsigned long long) vectors[k].hash);
+      error = 0x4a54;
+    }
+  }
+  return error;
+}
+
+void print_bench_usage(char *program) {
+  printf("usage: %s [--size N] [--repeat N] [--seed N] [--dis PATH|--no-dis] [--jobs N] [--json]\n", program);
+}
+
+int parse_bench_options(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    char *value;
+    if ((value = option_value(argc, argv, &i, "--size"))) {
+      bench.size = strtoul(value, NULL, 0);
+    } else if ((value = option_value(argc, argv, &i, "--repeat"))) {
+      bench.repeat = atoi(value);
+    } else if ((value = option_value(argc, argv, &i, "--seed"))) {
+      bench.seed = strtoull(value, NULL, 0);
+    } else if ((value = option_value(argc, argv, &i, "--dis"))) {
+      bench.dis_path = value;
+    } else if ((value = option_value(argc, argv, &i, "--jobs"))) {
+      bench.jobs = atoi(value);
+    } else if (!strcmp(argv[i], "--no-dis")) {
+      bench.dis_path = "";
+    } else if (!strcmp(argv[i], "--json")) {
+      bench.json = true;
+    } else {
+      print_bench_usage(argv[0]);
+      return 0xba5;
+    }
+  }
+  if (bench.size < 64 || bench.size > (1u << 26) || bench.repeat < 1 || bench.jobs < 0 || bench.jobs > 1024) {
+    printf("--size must be between 64 and 2^26, --repeat at least 1 and --jobs between 0 and 1024\n");
+    return 0xba5;
+  }
+  // By default up to one job per online core
+  if (bench.jobs == 0) bench.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (bench.jobs < 1) bench.jobs = 1;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (parse_bench_options(argc, argv) != 0) return 1;
+  if (check_hash() != 0) return 1;
+
+  if (bench.json) {
+    printf("{\n  \"kernel\": \"%s\",\n  \"seed\": %llu,\n  \"repeat\": %d,\n  \"results\": [",
+           decode_kernel_name(), (unsigned long long) bench.seed, bench.repeat);
+  } else {
+    printf("# kernel %s, seed %llu, best of %d\n", decode_kernel_name(), (unsigned long long) bench.seed, bench.repeat);
+    printf("%-8s %-14s %10s %8s %10s %10s\n", "corpus", "stage", "insns", "symbols", "ns/insn", "M insn/s");
+  }
+
+  // uniform: random words, mostly UNKNOWN; mix: compiled-code-like RV32IM with a
+  // function every 16-256 instructions; symbols: the same with one every 2-8;
+  // large: the mix at 16 times the size
+  int error = 0;
+  struct { const char *name; uint32_t scale; int uniform; uint32_t min_gap; uint32_t max_gap; } corpora[] = {
+    {"uniform", 1,  true,  16, 256},
+    {"mix",     1,  false, 16, 256},
+    {"symbols", 1,  false, 2,  8},
+    {"large",   16, false, 16, 256},
+  };
+  for (size_t k = 0; k < sizeof(corpora) / sizeof(corpora[0]) && error == 0; k++) {
+    corpus c;
+    error = generate_corpus(&c, corpora[k].name, bench.size * corpora[k].scale, corpora[k].uniform,
+                            corpora[k].min_gap, corpora[k].max_gap, bench.seed + k);
+    if (error != 0) break;
+    error = bench_corpus(&c);
+    free_corpus(&c);
+    fflush(stdout);
+  }
+
+  if (bench.json) printf("\n  ]\n}\n");
+  return error == 0 ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+#ifndef BIN_FORMAT_H
+#define BIN_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Output of `dis --format=bin`, for tools that want the decoded fields rather
+// than text. Everything is little-endian and aligned, so a file can be mapped
+// and used in place:
+//
+//   bin_header                       at 0
+//   bin_symbol[symbol_count]         at symbols_offset, sorted by address
+//   names, each NUL-terminated       at strings_offset, strings_size bytes
+//   bin_record[record_count]         at records_offset, a multiple of 8
+//
+// A --raw stream cannot know its length up front. It has BIN_UNSIZED set and
+// its records run to the end of the file.
+
+#define BIN_MAGIC       "RVDB"
+#define BIN_VERSION     1
+
+#define BIN_COMPRESSED  0x1     // decoded with RVC, so records can be 2 bytes apart
+#define BIN_UNSIZED     0x2     // record_count is 0, the records run to the end of the file
+
+typedef struct {
+  char     magic[4];            // BIN_MAGIC
+  uint16_t version;             // BIN_VERSION
+  uint16_t record_size;         // at least sizeof(bin_record) and a multiple of 4, later versions may append fields
+  uint32_t flags;
+  uint32_t record_count;
+  uint64_t records_offset;
+  uint32_t symbol_count;
+  uint32_t symbols_offset;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+} bin_header;
+
+typedef struct {
+  uint32_t address;
+  uint32_t name;                // offset of the name in the string table
+} bin_symbol;
+
+// One instruction, the fields are those of decoded_instructions (see decoder.h)
+typedef struct {
+  uint32_t address;
+  uint32_t word;                // raw instruction, a compressed one in the low 16 bits
+  int32_t  imm;
+  uint32_t symbol;              // 1 + index of the function it is in, 0 before the first one
+  uint8_t  command;             // enum Command
+  uint8_t  format;              // enum Format
+  uint8_t  rd;
+  uint8_t  rs1;
+  uint8_t  rs2;
+  uint8_t  length;              // 2 or 4 bytes
+  uint8_t  reserved[2];
+} bin_record;
+
+// A mapped --format=bin file
+typedef struct {
+  const uint8_t    *data;
+  size_t            size;
+  const bin_header *header;
+  const bin_symbol *symbols;
+  const char       *strings;
+  const uint8_t    *records;
+  size_t            record_count;
+} bin_file;
+
+// Maps `path` and checks that every part lies inside it. Returns 0 on success
+// or an error code like the disassembler's.
+int bin_open(bin_file *file, const char *path);
+
+void bin_close(bin_file *file);
+
+// Steps by header->record_size, so files from later versions still read
+static inline const bin_record *bin_record_at(const bin_file *file, size_t index) {
+  return (const bin_record *) (file->records + index * file->header->record_size);
+}
+
+// Name of the function a record's `symbol` refers to, NULL for none
+const char *bin_symbol_name(const bin_file *file, uint32_t symbol);
+
+#endif
@@ -0,0 +1,69 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bin_format.h"
+
+// `count` items of `size` bytes at `offset` lie inside the file
+static inline int inside(const bin_file *file, uint64_t offset, uint64_t count, uint64_t size) {
+  return offset <= file->size && count <= (file->size - offset) / size;
+}
+
+int bin_open(bin_file *file, const char *path) {
+  memset(file, 0, sizeof(bin_file));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0x1f;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(bin_header)) {
+    close(fd);
+    return 0x5a11;
+  }
+  void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return 0x4ead;
+  file->data = data;
+  file->size = info.st_size;
+
+  const bin_header *header = data;
+  file->header = header;
+  if (memcmp(header->magic, BIN_MAGIC, 4) != 0 || header->version != BIN_VERSION) {
+    bin_close(file);
+    return 0xe1f;
+  }
+  if (header->record_size < sizeof(bin_record) || header->record_size % 4 != 0 || header->records_offset % 8 != 0 ||
+      header->symbols_offset % 4 != 0 ||
+      !inside(file, header->symbols_offset, header->symbol_count, sizeof(bin_symbol)) ||
+      !inside(file, header->strings_offset, header->strings_size, 1) ||
+      (header->strings_size > 0 && file->data[header->strings_offset + header->strings_size - 1] != 0) ||
+      header->records_offset > file->size) {
+    bin_close(file);
+    return 0x5ec7;
+  }
+  file->record_count = header->flags & BIN_UNSIZED ? (file->size - header->records_offset) / header->record_size
+                                                   : header->record_count;
+  if (!inside(file, header->records_offset, file->record_count, header->record_size)) {
+    bin_close(file);
+    return 0x5ec7;
+  }
+  file->symbols = (const bin_symbol *) (file->data + header->symbols_offset);
+  file->strings = (const char *) file->data + header->strings_offset;
+  file->records = file->data + header->records_offset;
+  for (uint32_t k = 0; k < header->symbol_count; k++) {
+    if (file->symbols[k].name >= header->strings_size) {
+      bin_close(file);
+      return 0x5ec7;
+    }
+  }
+  return 0;
+}
+
+void bin_close(bin_file *file) {
+  if (file->data) munmap((void *) file->data, file->size);
+  memset(file, 0, sizeof(bin_file));
+}
+
+const char *bin_symbol_name(const bin_file *file, uint32_t symbol) {
+  if (symbol == 0 || symbol > file->header->symbol_count) return NULL;
+  return file->strings + file->symbols[symbol - 1].name;
+}
@@ -0,0 +1,477 @@
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "decoder.h"
+
+const char* registers[32] = 
+           {"zero",
+     		"ra",
+		    "sp",
+		    "gp",
+		    "tp",
+		    "t0",
+		    "t1",
+		    "t2",
+		    "s0",
+		    "s1",
+		    "a0",
+		    "a1",
+		    "a2",
+		    "a3",
+		    "a4",
+		    "a5",
+		    "a6",
+		    "a7",
+		    "s2",
+		    "s3",
+		    "s4",
+		    "s5",
+		    "s6",
+		    "s7",
+		    "s8",
+		    "s9",
+		    "s10",
+		    "s11",
+		    "t3",
+		    "t4",
+		    "t5",
+		    "t6"};
+
+
+// command[a:b] inclusively i.e. [31:12]
+uint32_t get_slice(uint32_t cmd, uint8_t a, uint8_t b) {
+  return (cmd >> b) & ((1 << (a - b + 1)) - 1);
+}
+
+// Decoding is driven by the tables below instead of a chain of comparisons.
+// major_table is indexed by opcode[6:2] and funct3, and either holds the final
+// command or one of the DECODE_* steps for the few groups that still need
+// funct7 or the whole word to be inspected. Opcodes whose low bits are not 11
+// are not 32-bit instructions and never reach the tables.
+enum DecodeStep {
+  DECODE_OP = UNKNOWN + 1,     // OP:       funct7 selects the row of op_table
+  DECODE_SHIFT_IMM,            // OP-IMM:   funct7 selects the row of shift_imm_table
+  DECODE_FENCE,                // MISC-MEM: fm, rs1 and rd must be zero
+  DECODE_FENCE_I,              // MISC-MEM: whole word must match
+  DECODE_PRIV                  // SYSTEM:   ECALL / EBREAK whole word must match
+};
+
+#define U UNKNOWN
+#define ALL(cmd) {cmd, cmd, cmd, cmd, cmd, cmd, cmd, cmd}
+//                                     funct3:  000      001               010      011      100      101               110      111
+static const uint8_t major_table[32][8] = {
+  /* 00000 LOAD     */                        {LB,      LH,               LW,      U,       LBU,     LHU,              U,       U},
+  /* 00001          */ ALL(U),
+  /* 00010          */ ALL(U),
+  /* 00011 MISC-MEM */                        {DECODE_FENCE, DECODE_FENCE_I, U,    U,       U,       U,                U,       U},
+  /* 00100 OP-IMM   */                        {ADDI,    DECODE_SHIFT_IMM, SLTI,    SLTIU,   XORI,    DECODE_SHIFT_IMM, ORI,     ANDI},
+  /* 00101 AUIPC    */ ALL(AUIPC),
+  /* 00110          */ ALL(U),
+  /* 00111          */ ALL(U),
+  /* 01000 STORE    */                        {SB,      SH,               SW,      U,       U,       U,                U,       U},
+  /* 01001          */ ALL(U),
+  /* 01010          */ ALL(U),
+  /* 01011          */ ALL(U),
+  /* 01100 OP       */ ALL(DECODE_OP),
+  /* 01101 LUI      */ ALL(LUI),
+  /* 01110          */ ALL(U),
+  /* 01111          */ ALL(U),
+  /* 10000          */ ALL(U),
+  /* 10001          */ ALL(U),
+  /* 10010          */ ALL(U),
+  /* 10011          */ ALL(U),
+  /* 10100          */ ALL(U),
+  /* 10101          */ ALL(U),
+  /* 10110          */ ALL(U),
+  /* 10111          */ ALL(U),
+  /* 11000 BRANCH   */                        {BEQ,     BNE,              U,       U,       BLT,     BGE,              BLTU,    BGEU},
+  /* 11001 JALR     */                        {JALR,    U,                U,       U,       U,       U,                U,       U},
+  /* 11010          */ ALL(U),
+  /* 11011 JAL      */ ALL(JAL),
+  /* 11100 SYSTEM   */                        {DECODE_PRIV, CSRRW,        CSRRS,   CSRRC,   U,       CSRRWI,           CSRRSI,  CSRRCI},
+  /* 11101          */ ALL(U),
+  /* 11110          */ ALL(U),
+  /* 11111          */ ALL(U)
+};
+
+// Row of op_table / shift_imm_table for every funct7 value, 0 is the UNKNOWN row.
+static const uint8_t funct7_row[128] = {
+  [0b0000000] = 1,
+  [0b0100000] = 2,
+  [0b0000001] = 3
+};
+
+//                               funct3:  000      001      010      011      100      101      110      111
+static const uint8_t op_table[4][8] = {
+  /* ???????                */ ALL(U),
+  /* 0000000                */ {ADD,     SLL,     SLT,     SLTU,    XOR,     SRL,     OR,      AND},
+  /* 0100000                */ {SUB,     U,       U,       U,       U,       SRA,     U,       U},
+  /* 0000001 RV32M          */ {MUL,     MULH,    MULHSU,  MULHU,   DIV,     DIVU,    REM,     REMU}
+};
+
+static const uint8_t shift_imm_table[4][8] = {
+  /* ???????                */ ALL(U),
+  /* 0000000                */ {U,       SLLI,    U,       U,       U,       SRLI,    U,       U},
+  /* 0100000                */ {U,       U,       U,       U,       U,       SRAI,    U,       U},
+  /* 0000001                */ ALL(U)
+};
+#undef ALL
+#undef U
+
+enum Command get_command(uint32_t command){
+  if ((command & 0b11) != 0b11) return UNKNOWN;                                         //                                ___ __11
+  uint32_t com6_2   = get_slice(command, 6, 2);                                         // ____ ____ ____ ____ ____ ____ _xxx xx__
+  uint32_t com14_12 = get_slice(command, 14, 12);                                       // ____ ____ ____ ____ _xxx ____ ____ ____
+  uint8_t step = major_table[com6_2][com14_12];
+  if (step <= UNKNOWN) return step;
+  uint32_t com31_25 = get_slice(command, 31, 25);                                       // xxxx xxx_ ____ ____ ____ ____ ____ ____
+  switch (step) {
+    case DECODE_OP:        return op_table[funct7_row[com31_25]][com14_12];
+    case DECODE_SHIFT_IMM: return shift_imm_table[funct7_row[com31_25]][com14_12];
+    case DECODE_FENCE:     return (command & 0xf00fffff) == 0x0000000f ? FENCE : UNKNOWN;  // 0000 ____ ____ 0000 0000 0000 0000 1111
+    case DECODE_FENCE_I:   return command == 0x0000100f ? FENCE_I : UNKNOWN;               // 0000 0000 0000 0000 0001 0000 0000 1111
+    case DECODE_PRIV:
+      if (command == 0x00000073) return ECALL;                                          // 0000 0000 0000 0000 0000 0000 0111 0011
+      if (command == 0x00100073) return EBREAK;                                         // 0000 0000 0001 0000 0000 0000 0111 0011
+      return UNKNOWN;
+  }
+  return UNKNOWN;
+}
+
+const char* command_names[UNKNOWN + 1] = {
+  "lui", "auipc", "jal", "jalr", "beq", "bne", "blt", "bge", "bltu", "bgeu",
+  "lb", "lh", "lw", "lbu", "lhu", "sb", "sh", "sw",
+  "addi", "slti", "sltiu", "xori", "ori", "andi", "slli", "srli", "srai",
+  "add", "sub", "sll", "slt", "sltu", "xor", "srl", "sra", "or", "and",
+  "fence", "fence.i", "ecall", "ebreak", "csrrw", "csrrs", "csrrc", "csrrwi", "csrrsi", "csrrci",
+  "mul", "mulh", "mulhsu", "mulhu", "div", "divu", "rem", "remu",
+  "unknown"
+};
+
+// Rounded up to whole 32-bit words so that the AVX2 kernel can gather from it
+const uint8_t command_formats[(UNKNOWN + 4) & ~3] = {
+  [LUI]     = FORMAT_U,       [AUIPC]   = FORMAT_U,
+  [JAL]     = FORMAT_J,       [JALR]    = FORMAT_I,
+  [BEQ]     = FORMAT_B,       [BNE]     = FORMAT_B,       [BLT]     = FORMAT_B,
+  [BGE]     = FORMAT_B,       [BLTU]    = FORMAT_B,       [BGEU]    = FORMAT_B,
+  [LB]      = FORMAT_I,       [LH]      = FORMAT_I,       [LW]      = FORMAT_I,
+  [LBU]     = FORMAT_I,       [LHU]     = FORMAT_I,
+  [SB]      = FORMAT_S,       [SH]      = FORMAT_S,       [SW]      = FORMAT_S,
+  [ADDI]    = FORMAT_I,       [SLTI]    = FORMAT_I,       [SLTIU]   = FORMAT_I,
+  [XORI]    = FORMAT_I,       [ORI]     = FORMAT_I,       [ANDI]    = FORMAT_I,
+  [SLLI]    = FORMAT_SHAMT,   [SRLI]    = FORMAT_SHAMT,   [SRAI]    = FORMAT_SHAMT,
+  [ADD]     = FORMAT_R,       [SUB]     = FORMAT_R,       [SLL]     = FORMAT_R,
+  [SLT]     = FORMAT_R,       [SLTU]    = FORMAT_R,       [XOR]     = FORMAT_R,
+  [SRL]     = FORMAT_R,       [SRA]     = FORMAT_R,       [OR]      = FORMAT_R,
+  [AND]     = FORMAT_R,
+  [FENCE]   = FORMAT_FENCE,   [FENCE_I] = FORMAT_SYSTEM,
+  [ECALL]   = FORMAT_SYSTEM,  [EBREAK]  = FORMAT_SYSTEM,
+  [CSRRW]   = FORMAT_CSR,     [CSRRS]   = FORMAT_CSR,     [CSRRC]   = FORMAT_CSR,
+  [CSRRWI]  = FORMAT_CSR_IMM, [CSRRSI]  = FORMAT_CSR_IMM, [CSRRCI]  = FORMAT_CSR_IMM,
+  [MUL]     = FORMAT_R,       [MULH]    = FORMAT_R,       [MULHSU]  = FORMAT_R,
+  [MULHU]   = FORMAT_R,       [DIV]     = FORMAT_R,       [DIVU]    = FORMAT_R,
+  [REM]     = FORMAT_R,       [REMU]    = FORMAT_R,
+  [UNKNOWN] = FORMAT_UNKNOWN
+};
+
+size_t decoded_size(size_t capacity) {
+  return capacity * (sizeof(int32_t) + 6);
+}
+
+// imm comes first so that it is aligned like the block, the byte arrays follow
+void place_decoded(decoded_instructions *decoded, void *memory, size_t capacity) {
+  uint8_t *bytes = (uint8_t *) memory + capacity * sizeof(int32_t);
+  decoded->imm      = memory;
+  decoded->command  = bytes;
+  decoded->format   = bytes + capacity;
+  decoded->rd       = bytes + capacity * 2;
+  decoded->rs1      = bytes + capacity * 3;
+  decoded->rs2      = bytes + capacity * 4;
+  decoded->length   = bytes + capacity * 5;
+  decoded->capacity = capacity;
+}
+
+int alloc_decoded(decoded_instructions *decoded, size_t capacity) {
+  void *memory = malloc(decoded_size(capacity));
+  if (!memory) {
+    memset(decoded, 0, sizeof(decoded_instructions));
+    return 0xa110c;
+  }
+  place_decoded(decoded, memory, capacity);
+  return 0;
+}
+
+void free_decoded(decoded_instructions *decoded) {
+  free(decoded->imm);
+  memset(decoded, 0, sizeof(decoded_instructions));
+}
+
+decoded_instructions decoded_at(const decoded_instructions *decoded, size_t offset) {
+  decoded_instructions view = {
+    .command  = decoded->command + offset,
+    .format   = decoded->format + offset,
+    .rd       = decoded->rd + offset,
+    .rs1      = decoded->rs1 + offset,
+    .rs2      = decoded->rs2 + offset,
+    .imm      = decoded->imm + offset,
+    .length   = decoded->length + offset,
+    .capacity = decoded->capacity - offset
+  };
+  return view;
+}
+
+// Sign-extends the low `bits` bits of `value`
+static int32_t sign_extend(uint32_t value, int bits) {
+  return (int32_t) (value << (32 - bits)) >> (32 - bits);
+}
+
+int32_t get_immediate(uint32_t command, enum Format format) {
+  switch (format) {
+    case FORMAT_I:
+      return sign_extend(get_slice(command, 31, 20), 12);                                   // xxxx xxxx xxxx ____ ____ ____ ____ ____
+    case FORMAT_S:
+      return sign_extend((get_slice(command, 31, 25) << 5)                                  // xxxx xxx_ ____ ____ ____ ____ ____ ____
+                       | get_slice(command, 11, 7), 12);                                    // ____ ____ ____ ____ ____ xxxx x___ ____
+    case FORMAT_B:
+      return sign_extend((get_slice(command, 31, 31) << 12)                                 // x___ ____ ____ ____ ____ ____ ____ ____
+                       | (get_slice(command, 7, 7) << 11)                                   // ____ ____ ____ ____ ____ ____ x___ ____
+                       | (get_slice(command, 30, 25) << 5)                                  // _xxx xxx_ ____ ____ ____ ____ ____ ____
+                       | (get_slice(command, 11, 8) << 1), 13);                             // ____ ____ ____ ____ ____ xxxx ____ ____
+    case FORMAT_U:
+      return command & 0xfffff000;                                                          // xxxx xxxx xxxx xxxx xxxx ____ ____ ____
+    case FORMAT_J:
+      return sign_extend((get_slice(command, 31, 31) << 20)                                 // x___ ____ ____ ____ ____ ____ ____ ____
+                       | (get_slice(command, 19, 12) << 12)                                 // ____ ____ ____ xxxx xxxx ____ ____ ____
+                       | (get_slice(command, 20, 20) << 11)                                 // ____ ____ ___x ____ ____ ____ ____ ____
+                       | (get_slice(command, 30, 21) << 1), 21);                            // _xxx xxxx xxx_ ____ ____ ____ ____ ____
+    case FORMAT_SHAMT:
+      return get_slice(command, 24, 20);                                                    // ____ ___x xxxx ____ ____ ____ ____ ____
+    case FORMAT_FENCE:
+    case FORMAT_CSR:
+    case FORMAT_CSR_IMM:
+      return get_slice(command, 31, 20);                                                    // xxxx xxxx xxxx ____ ____ ____ ____ ____
+    default:
+      return 0;
+  }
+}
+
+void decode_instructions_scalar(const uint32_t *words, size_t count, decoded_instructions *decoded) {
+  for (size_t i = 0; i < count; i++) {
+    uint32_t command = words[i];
+    enum Command cmd = get_command(command);
+    enum Format format = command_formats[cmd];
+    decoded->command[i] = cmd;
+    decoded->format[i]  = format;
+    decoded->rd[i]      = get_slice(command, 11, 7);                                        // ____ ____ ____ ____ ____ xxxx x___ ____
+    decoded->rs1[i]     = get_slice(command, 19, 15);                                       // ____ ____ ____ xxxx x___ ____ ____ ____
+    decoded->rs2[i]     = get_slice(command, 24, 20);                                       // ____ ___x xxxx ____ ____ ____ ____ ____
+    decoded->imm[i]     = get_immediate(command, format);
+    decoded->length[i]  = 4;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The vector kernels compute every field and every immediate layout for all
+// lanes and then keep the one that the format of the lane asks for, so they
+// have no per-word branches. Classification uses the same tables as
+// get_command(), with the few whole-word checks done as vector compares.
+
+#define AVX2 __attribute__((target("avx2")))
+
+// table[index] for 8 byte-sized entries. Each lane loads the aligned 32-bit
+// word holding its byte, so tables must be a multiple of 4 bytes long.
+static inline AVX2 __m256i gather_bytes(const uint8_t *table, __m256i index) {
+  const __m256i three = _mm256_set1_epi32(3);
+  __m256i words = _mm256_i32gather_epi32((const int *) table, _mm256_andnot_si256(three, index), 1);
+  __m256i shift = _mm256_slli_epi32(_mm256_and_si256(index, three), 3);
+  return _mm256_and_si256(_mm256_srlv_epi32(words, shift), _mm256_set1_epi32(0xff));
+}
+
+// Low byte of each of the 8 lanes
+static inline AVX2 void store_bytes(uint8_t *destination, __m256i values) {
+  const __m256i low_bytes = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                             0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  __m256i packed = _mm256_shuffle_epi8(values, low_bytes);
+  packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0));
+  _mm_storel_epi64((__m128i *) destination, _mm256_castsi256_si128(packed));
+}
+
+// Lanes of `value` where `mask` is set, the rest of `current`
+static inline AVX2 __m256i select_where(__m256i mask, __m256i value, __m256i current) {
+  return _mm256_blendv_epi8(current, value, mask);
+}
+
+static inline AVX2 __m256i lanes_equal(__m256i a, int b) {
+  return _mm256_cmpeq_epi32(a, _mm256_set1_epi32(b));
+}
+
+static inline AVX2 __m256i bits_of(__m256i word, int high, int low) {
+  return _mm256_and_si256(_mm256_srli_epi32(word, low), _mm256_set1_epi32((1 << (high - low + 1)) - 1));
+}
+
+AVX2 void decode_instructions_avx2(const uint32_t *words, size_t count, decoded_instructions *decoded) {
+  const __m256i unknown = _mm256_set1_epi32(UNKNOWN);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i word   = _mm256_loadu_si256((const __m256i *) (words + i));
+    __m256i com6_2   = bits_of(word, 6, 2);
+    __m256i com14_12 = bits_of(word, 14, 12);
+    __m256i com31_25 = _mm256_srli_epi32(word, 25);
+
+    // get_command()
+    __m256i step = gather_bytes(&major_table[0][0], _mm256_or_si256(_mm256_slli_epi32(com6_2, 3), com14_12));
+    __m256i row  = _mm256_or_si256(_mm256_slli_epi32(gather_bytes(funct7_row, com31_25), 3), com14_12);
+    __m256i command = step;
+    command = select_where(lanes_equal(step, DECODE_OP), gather_bytes(&op_table[0][0], row), command);
+    command = select_where(lanes_equal(step, DECODE_SHIFT_IMM), gather_bytes(&shift_imm_table[0][0], row), command);
+    __m256i fence   = lanes_equal(_mm256_and_si256(word, _mm256_set1_epi32(0xf00fffff)), 0x0000000f);
+    __m256i fence_i = lanes_equal(word, 0x0000100f);
+    __m256i ecall   = lanes_equal(word, 0x00000073);
+    __m256i ebreak  = lanes_equal(word, 0x00100073);
+    command = select_where(lanes_equal(step, DECODE_FENCE),
+                           select_where(fence, _mm256_set1_epi32(FENCE), unknown), command);
+    command = select_where(lanes_equal(step, DECODE_FENCE_I),
+                           select_where(fence_i, _mm256_set1_epi32(FENCE_I), unknown), command);
+    command = select_where(lanes_equal(step, DECODE_PRIV),
+                           select_where(ecall, _mm256_set1_epi32(ECALL),
+                                        select_where(ebreak, _mm256_set1_epi32(EBREAK), unknown)), command);
+    __m256i not_32bit = _mm256_xor_si256(lanes_equal(_mm256_and_si256(word, _mm256_set1_epi32(0b11)), 0b11),
+                                         _mm256_set1_epi32(-1));
+    command = select_where(not_32bit, unknown, command);
+    __m256i format = gather_bytes(command_formats, command);
+
+    // get_immediate()
+    __m256i sign  = _mm256_srai_epi32(word, 31);
+    __m256i imm_i = _mm256_srai_epi32(word, 20);
+    __m256i imm_s = _mm256_or_si256(_mm256_slli_epi32(_mm256_srai_epi32(word, 25), 5), bits_of(word, 11, 7));
+    __m256i imm_b = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(sign, 12),
+                                                    _mm256_and_si256(_mm256_slli_epi32(word, 4), _mm256_set1_epi32(0x800))),
+                                    _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(word, 20), _mm256_set1_epi32(0x7e0)),
+                                                    _mm256_and_si256(_mm256_srli_epi32(word, 7), _mm256_set1_epi32(0x1e))));
+    __m256i imm_u = _mm256_and_si256(word, _mm256_set1_epi32(0xfffff000));
+    __m256i imm_j = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(sign, 20),
+                                                    _mm256_and_si256(word, _mm256_set1_epi32(0xff000))),
+                                    _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(word, 9), _mm256_set1_epi32(0x800)),
+                                                    _mm256_and_si256(_mm256_srli_epi32(word, 20), _mm256_set1_epi32(0x7fe))));
+    __m256i imm = _mm256_setzero_si256();
+    imm = select_where(lanes_equal(format, FORMAT_I), imm_i, imm);
+    imm = select_where(lanes_equal(format, FORMAT_S), imm_s, imm);
+    imm = select_where(lanes_equal(format, FORMAT_B), imm_b, imm);
+    imm = select_where(lanes_equal(format, FORMAT_U), imm_u, imm);
+    imm = select_where(lanes_equal(format, FORMAT_J), imm_j, imm);
+    imm = select_where(lanes_equal(format, FORMAT_SHAMT), bits_of(word, 24, 20), imm);
+    imm = select_where(_mm256_or_si256(lanes_equal(format, FORMAT_FENCE),
+                                       _mm256_or_si256(lanes_equal(format, FORMAT_CSR), lanes_equal(format, FORMAT_CSR_IMM))),
+                       _mm256_srli_epi32(word, 20), imm);
+
+    store_bytes(decoded->command + i, command);
+    store_bytes(decoded->format + i, format);
+    store_bytes(decoded->rd + i, bits_of(word, 11, 7));
+    store_bytes(decoded->rs1 + i, bits_of(word, 19, 15));
+    store_bytes(decoded->rs2 + i, bits_of(word, 24, 20));
+    _mm256_storeu_si256((__m256i *) (decoded->imm + i), imm);
+    _mm_storel_epi64((__m128i *) (decoded->length + i), _mm_set1_epi8(4));
+  }
+  decoded_instructions tail = decoded_at(decoded, i);
+  decode_instructions_scalar(words + i, count - i, &tail);
+}
+
+// SSE2 has no gathers and no variable blends, so classification stays a
+// table lookup per lane and only field and immediate extraction is vectorized
+static inline __m128i sse2_select(__m128i mask, __m128i value, __m128i current) {
+  return _mm_or_si128(_mm_and_si128(mask, value), _mm_andnot_si128(mask, current));
+}
+
+static inline __m128i sse2_equal(__m128i a, int b) {
+  return _mm_cmpeq_epi32(a, _mm_set1_epi32(b));
+}
+
+static inline __m128i sse2_bits(__m128i word, int high, int low) {
+  return _mm_and_si128(_mm_srli_epi32(word, low), _mm_set1_epi32((1 << (high - low + 1)) - 1));
+}
+
+// Low byte of each of the 4 lanes, the values must fit in 0..127
+static inline void sse2_store_bytes(uint8_t *destination, __m128i values) {
+  __m128i packed = _mm_packus_epi16(_mm_packs_epi32(values, values), values);
+  uint32_t bytes = _mm_cvtsi128_si32(packed);
+  memcpy(destination, &bytes, 4);
+}
+
+void decode_instructions_sse2(const uint32_t *words, size_t count, decoded_instructions *decoded) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i word = _mm_loadu_si128((const __m128i *) (words + i));
+    uint8_t commands[4];
+    for (int lane = 0; lane < 4; lane++) {
+      commands[lane] = get_command(words[i + lane]);
+    }
+    __m128i format = _mm_setr_epi32(command_formats[commands[0]], command_formats[commands[1]],
+                                    command_formats[commands[2]], command_formats[commands[3]]);
+
+    __m128i sign  = _mm_srai_epi32(word, 31);
+    __m128i imm_i = _mm_srai_epi32(word, 20);
+    __m128i imm_s = _mm_or_si128(_mm_slli_epi32(_mm_srai_epi32(word, 25), 5), sse2_bits(word, 11, 7));
+    __m128i imm_b = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(sign, 12),
+                                              _mm_and_si128(_mm_slli_epi32(word, 4), _mm_set1_epi32(0x800))),
+                                 _mm_or_si128(_mm_and_si128(_mm_srli_epi32(word, 20), _mm_set1_epi32(0x7e0)),
+                                              _mm_and_si128(_mm_srli_epi32(word, 7), _mm_set1_epi32(0x1e))));
+    __m128i imm_u = _mm_and_si128(word, _mm_set1_epi32(0xfffff000));
+    __m128i imm_j = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(sign, 20),
+                                              _mm_and_si128(word, _mm_set1_epi32(0xff000))),
+                                 _mm_or_si128(_mm_and_si128(_mm_srli_epi32(word, 9), _mm_set1_epi32(0x800)),
+                                              _mm_and_si128(_mm_srli_epi32(word, 20), _mm_set1_epi32(0x7fe))));
+    __m128i imm = _mm_setzero_si128();
+    imm = sse2_select(sse2_equal(format, FORMAT_I), imm_i, imm);
+    imm = sse2_select(sse2_equal(format, FORMAT_S), imm_s, imm);
+    imm = sse2_select(sse2_equal(format, FORMAT_B), imm_b, imm);
+    imm = sse2_select(sse2_equal(format, FORMAT_U), imm_u, imm);
+    imm = sse2_select(sse2_equal(format, FORMAT_J), imm_j, imm);
+    imm = sse2_select(sse2_equal(format, FORMAT_SHAMT), sse2_bits(word, 24, 20), imm);
+    imm = sse2_select(_mm_or_si128(sse2_equal(format, FORMAT_FENCE),
+                                   _mm_or_si128(sse2_equal(format, FORMAT_CSR), sse2_equal(format, FORMAT_CSR_IMM))),
+                      _mm_srli_epi32(word, 20), imm);
+
+    memcpy(decoded->command + i, commands, 4);
+    sse2_store_bytes(decoded->format + i, format);
+    sse2_store_bytes(decoded->rd + i, sse2_bits(word, 11, 7));
+    sse2_store_bytes(decoded->rs1 + i, sse2_bits(word, 19, 15));
+    sse2_store_bytes(decoded->rs2 + i, sse2_bits(word, 24, 20));
+    _mm_storeu_si128((__m128i *) (decoded->imm + i), imm);
+    memset(decoded->length + i, 4, 4);
+  }
+  decoded_instructions tail = decoded_at(decoded, i);
+  decode_instructions_scalar(words + i, count - i, &tail);
+}
+
+#undef AVX2
+
+const char *decode_kernel_name(void) {
+  if (__builtin_cpu_supports("avx2")) return "avx2";
+  if (__builtin_cpu_supports("sse2")) return "sse2";
+  return "scalar";
+}
+
+void decode_instructions(const uint32_t *words, size_t count, decoded_instructions *decoded) {
+  if (__builtin_cpu_supports("avx2")) {
+    decode_instructions_avx2(words, count, decoded);
+  } else if (__builtin_cpu_supports("sse2")) {
+    decode_instructions_sse2(words, count, decoded);
+  } else {
+    decode_instructions_scalar(words, count, decoded);
+  }
+}
+
+#else
+
+const char *decode_kernel_name(void) {
+  return "scalar";
+}
+
+void decode_instructions(const uint32_t *words, size_t count, decoded_instructions *decoded) {
+  decode_instructions_scalar(words, count, decoded);
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// RV32IM decoder, usable without the text output of the disassembler.
+// Link with libdecoder.a (see Makefile).
+
+enum Command {
+	// RV32I
+	LUI,
+        AUIPC,
+	JAL,
+	JALR,
+	BEQ,
+	BNE,
+	BLT,
+	BGE,
+	BLTU,
+	BGEU,
+	LB,
+	LH,
+	LW,
+	LBU,
+	LHU,
+	SB,
+	SH,
+	SW,
+	ADDI,
+	SLTI,
+	SLTIU,
+	XORI,
+	ORI,
+	ANDI,
+	SLLI,
+	SRLI,
+	SRAI,
+	ADD,
+	SUB,
+	SLL,
+	SLT,
+	SLTU,
+	XOR,
+	SRL,
+	SRA,
+	OR,
+	AND,
+	FENCE,
+	FENCE_I,
+	ECALL,
+	EBREAK,
+	CSRRW,
+	CSRRS,
+	CSRRC,
+	CSRRWI,
+	CSRRSI,
+	CSRRCI,
+
+        // RV32M
+	MUL,
+	MULH,
+	MULHSU,
+	MULHU,
+	DIV,
+	DIVU,
+	REM,
+	REMU,
+
+	UNKNOWN
+};
+
+// Operand layout of an instruction, which fields of decoded_instructions are meaningful
+enum Format {
+  FORMAT_R,           // rd, rs1, rs2
+  FORMAT_I,           // rd, rs1, imm
+  FORMAT_SHAMT,       // rd, rs1, imm = shift amount
+  FORMAT_S,           // rs1, rs2, imm
+  FORMAT_B,           // rs1, rs2, imm = byte offset
+  FORMAT_U,           // rd, imm = upper immediate, low 12 bits zero
+  FORMAT_J,           // rd, imm = byte offset
+  FORMAT_FENCE,       // imm = fm:pred:succ, bits [31:20] of the word
+  FORMAT_SYSTEM,      // no operands
+  FORMAT_CSR,         // rd, rs1, imm = csr number
+  FORMAT_CSR_IMM,     // rd, rs1 = zimm, imm = csr number
+  FORMAT_UNKNOWN      // no operands
+};
+
+extern const char* registers[32];
+
+// Mnemonic of every enum Command, "unknown" for UNKNOWN
+extern const char* command_names[UNKNOWN + 1];
+
+// Format of every enum Command
+extern const uint8_t command_formats[];
+
+// command[a:b] inclusively i.e. [31:12]
+uint32_t get_slice(uint32_t cmd, uint8_t a, uint8_t b);
+
+enum Command get_command(uint32_t command);
+
+// Immediate of a 32-bit instruction as it is stored in decoded_instructions.imm
+int32_t get_immediate(uint32_t command, enum Format format);
+
+// Decoded instructions as a structure of arrays, entry i of every array belongs
+// to the same instruction. rd, rs1 and rs2 always hold the raw register fields
+// (of the expanded 32-bit form for compressed instructions); imm is sign-extended
+// for I, S, B, U and J formats and zero-extended for the others.
+typedef struct {
+  uint8_t  *command;    // enum Command
+  uint8_t  *format;     // enum Format
+  uint8_t  *rd;
+  uint8_t  *rs1;
+  uint8_t  *rs2;
+  int32_t  *imm;
+  uint8_t  *length;     // bytes taken by the instruction, 2 when it is compressed
+  size_t    capacity;
+} decoded_instructions;
+
+// Allocates room for `capacity` instructions as one block, returns 0 on success
+int alloc_decoded(decoded_instructions *decoded, size_t capacity);
+
+void free_decoded(decoded_instructions *decoded);
+
+// For callers that manage their own memory: place_decoded() lays the arrays for
+// `capacity` instructions out in `memory`, which must be 4-byte aligned and
+// decoded_size(capacity) bytes long. Such arrays are not passed to free_decoded().
+size_t decoded_size(size_t capacity);
+void place_decoded(decoded_instructions *decoded, void *memory, size_t capacity);
+
+// The entries of `decoded` from `offset` on, sharing its arrays
+decoded_instructions decoded_at(const decoded_instructions *decoded, size_t offset);
+
+// Decodes words[0..count) into entries [0..count) of `decoded`, count must not exceed its capacity
+void decode_instructions(const uint32_t *words, size_t count, decoded_instructions *decoded);
+
+// The kernels behind decode_instructions(), which picks the widest one the CPU
+// supports at run time. They all produce the same arrays; the SIMD ones only
+// exist on x86.
+void decode_instructions_scalar(const uint32_t *words, size_t count, decoded_instructions *decoded);
+#if defined(__x86_64__) || defined(__i386__)
+void decode_instructions_sse2(const uint32_t *words, size_t count, decoded_instructions *decoded);
+void decode_instructions_avx2(const uint32_t *words, size_t count, decoded_instructions *decoded);
+#endif
+
+// Name of the kernel decode_instructions() uses on this CPU: "avx2", "sse2" or "scalar"
+const char *decode_kernel_name(void);
+
+// Decodes a mix of 16-bit RVC and 32-bit instructions from parcels[0..parcel_count),
+// stopping when `decoded` is full or the next instruction does not fit. Compressed
+// instructions are reported as the command they expand to. Returns the number of
+// instructions, *consumed receives the number of parcels they took.
+size_t decode_parcels(const uint16_t *parcels, size_t parcel_count, decoded_instructions *decoded, size_t *consumed);
+
+// Parcels taken by the instruction starting with `parcel`: 1 for RVC, 2 otherwise
+static inline int parcels_of(uint16_t parcel) {
+  return (parcel & 0b11) == 0b11 ? 2 : 1;
+}
+
+#endif
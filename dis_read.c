@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include "bin_format.h"
+#include "decoder.h"
+
+// Prints a `dis --format=bin` file one record per line, mostly to show how the
+// reader is used: address, raw word, mnemonic, rd, rs1, rs2, imm and function.
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    printf("usage: %s <file.bin>\n", argv[0]);
+    return 1;
+  }
+  bin_file file;
+  int error = bin_open(&file, argv[1]);
+  if (error != 0) {
+    printf("%s is not a readable --format=bin file (error 0x%x)\n", argv[1], error);
+    return 1;
+  }
+  for (size_t k = 0; k < file.record_count; k++) {
+    const bin_record *record = bin_record_at(&file, k);
+    const char *symbol = bin_symbol_name(&file, record->symbol);
+    const char *name = record->command <= UNKNOWN ? command_names[record->command] : "?";
+    printf("%08x %0*x %-8s %-4s %-4s %-4s %11d %s\n", record->address, record->length * 2, record->word, name,
+           registers[record->rd & 31], registers[record->rs1 & 31], registers[record->rs2 & 31], record->imm,
+           symbol ? symbol : "-");
+  }
+  bin_close(&file);
+  return 0;
+}
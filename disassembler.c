@@ -3,187 +3,146 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include "decoder.h"
+#include "bin_format.h"
 
 #define true  1
 #define false 0
 
-const char* registers[] = 
-           {"zero",
-     		"ra",
-		    "sp",
-		    "gp",
-		    "tp",
-		    "t0",
-		    "t1",
-		    "t2",
-		    "s0",
-		    "s1",
-		    "a0",
-		    "a1",
-		    "a2",
-		    "a3",
-		    "a4",
-		    "a5",
-		    "a6",
-		    "a7",
-		    "s2",
-		    "s3",
-		    "s4",
-		    "s5",
-		    "s6",
-		    "s7",
-		    "s8",
-		    "s9",
-		    "s10",
-		    "s11",
-		    "t3",
-		    "t4",
-		    "t5",
-		    "t6"};
-
-enum Command {
-	// RV32I
-	LUI,
-        AUIPC,
-	JAL,
-	JALR,
-	BEQ,
-	BNE,
-	BLT,
-	BGE,
-	BLTU,
-	BGEU,
-	LB,
-	LH,
-	LW,
-	LBU,
-	LHU,
-	SB,
-	SH,
-	SW,
-	ADDI,
-	SLTI,
-	SLTIU,
-	XORI,
-	ORI,
-	ANDI,
-	SLLI,
-	SRLI,
-	SRAI,
-	ADD,
-	SUB,
-	SLL,
-	SLT,
-	SLTU,
-	XOR,
-	SRL,
-	SRA,
-	OR,
-	AND,
-	FENCE,
-	FENCE_I,
-	ECALL,
-	EBREAK,
-	CSRRW,
-	CSRRS,
-	CSRRC,
-	CSRRWI,
-	CSRRSI,
-	CSRRCI,
-
-        // RV32M
-	MUL,
-	MULH,
-	MULHSU,
-	MULHU,
-	DIV,
-	DIVU,
-	REM,
-	REMU,
-
-	UNKNOWN
-} Command;
-
-// command[a:b] inclusively i.e. [31:12]
-uint32_t get_slice(uint32_t cmd, uint8_t a, uint8_t b) {
-  return (cmd >> b) & ((1 << (a - b + 1)) - 1);
-}
-
-enum Command get_command(uint32_t command){
-  uint32_t com6_0   = get_slice(command, 6, 0);                                         // ____ ____ ____ ____ ____ ____ _xxx xxxx
-  uint32_t com11_7  = get_slice(command, 11, 7);                                        // ____ ____ ____ ____ ____ xxxx x___ ____
-  uint32_t com14_12 = get_slice(command, 14, 12);                                       // ____ ____ ____ ____ _xxx ____ ____ ____
-  uint32_t com19_15 = get_slice(command, 19, 15);                                       // ____ ____ ____ xxxx x___ ____ ____ ____
-  uint32_t com24_20 = get_slice(command, 24, 20);                                       // ____ ___x xxxx ____ ____ ____ ____ ____
-  uint32_t com31_25 = get_slice(command, 31, 25);                                       // xxxx xxx_ ____ ____ ____ ____ ____ ____
-  uint32_t com31_20 = get_slice(command, 31, 20);                                       // xxxx xxxx xxxx ____ ____ ____ ____ ____
-  uint32_t com31_28 = get_slice(command, 31, 28);                                       // xxxx ____ ____ ____ ____ ____ ____ ____
-  uint32_t com27_25 = get_slice(command, 27, 25);                                       // ____ xxxx ____ ____ ____ ____ ____ ____
-  uint32_t com24_21 = get_slice(command, 24, 21);                                       // ____ ____ xxxx ____ ____ ____ ____ ____
-  uint32_t com19_0  = get_slice(command, 19, 0);                                        // ____ ____ ____ ____ xxxx xxxx xxxx xxxx
-  if (com6_0 == 0b0110111) return LUI;                                                  //                                011 0111
-  if (com6_0 == 0b0010111) return AUIPC;                                                //                                001 0111
-  if (com6_0 == 0b1101111) return JAL;                                                  //                                110 1111
-  if (com6_0 == 0b1100111 && com14_12 == 0b000) return JALR;                            //                      000       110 0111
-  if (com6_0 == 0b1100011 && com14_12 == 0b000) return BEQ;                             //                      000       110 0011
-  if (com6_0 == 0b1100011 && com14_12 == 0b001) return BNE;                             //                      001       110 0011
-  if (com6_0 == 0b1100011 && com14_12 == 0b100) return BLT;                             //                      100       110 0011
-  if (com6_0 == 0b1100011 && com14_12 == 0b101) return BGE;                             //                      101       110 0011
-  if (com6_0 == 0b1100011 && com14_12 == 0b110) return BLTU;                            //                      110       110 0011
-  if (com6_0 == 0b1100011 && com14_12 == 0b111) return BGEU;                            //                      111       110 0011
-  if (com6_0 == 0b0000011 && com14_12 == 0b000) return LB;                              //                      000       000 0011
-  if (com6_0 == 0b0000011 && com14_12 == 0b001) return LH;                              //                      001       000 0011
-  if (com6_0 == 0b0000011 && com14_12 == 0b010) return LW;                              //                      010       000 0011
-  if (com6_0 == 0b0000011 && com14_12 == 0b100) return LBU;                             //                      100       000 0011
-  if (com6_0 == 0b0000011 && com14_12 == 0b101) return LHU;                             //                      101       000 0011
-  if (com6_0 == 0b0100011 && com14_12 == 0b000) return SB;                              //                      000       010 0011
-  if (com6_0 == 0b0100011 && com14_12 == 0b001) return SH;                              //                      001       010 0011
-  if (com6_0 == 0b0100011 && com14_12 == 0b010) return SW;                              //                      010       010 0011
-  if (com6_0 == 0b0010011 && com14_12 == 0b000) return ADDI;                            //                      000       001 0011
-  if (com6_0 == 0b0010011 && com14_12 == 0b010) return SLTI;                            //                      010       001 0011
-  if (com6_0 == 0b0010011 && com14_12 == 0b011) return SLTIU;                           //                      011       001 0011
-  if (com6_0 == 0b0010011 && com14_12 == 0b100) return XORI;                            //                      100       001 0011
-  if (com6_0 == 0b0010011 && com14_12 == 0b110) return ORI;                             //                      110       001 0011
-  if (com6_0 == 0b0010011 && com14_12 == 0b111) return ANDI;                            //                      111       001 0011
-  if (com6_0 == 0b0010011 && com14_12 == 0b001 && com31_25 == 0b0000000) return SLLI;   // 0000 0000            001       001 0011
-  if (com6_0 == 0b0010011 && com14_12 == 0b101 && com31_25 == 0b0000000) return SRLI;   // 0000 0000            101       001 0011
-  if (com6_0 == 0b0010011 && com14_12 == 0b101 && com31_25 == 0b0100000) return SRAI;   // 0100 0000            101       001 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b000 && com31_25 == 0b0000000) return ADD;    // 0000 0000            000       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b000 && com31_25 == 0b0100000) return SUB;    // 0100 0000            000       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b001 && com31_25 == 0b0000000) return SLL;    // 0000 0000            001       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b010 && com31_25 == 0b0000000) return SLT;    // 0000 0000            010       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b011 && com31_25 == 0b0000000) return SLTU;   // 0000 0000            011       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b100 && com31_25 == 0b0000000) return XOR;    // 0000 0000            100       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b101 && com31_25 == 0b0000000) return SRL;    // 0000 0000            101       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b101 && com31_25 == 0b0100000) return SRA;    // 0100 0000            101       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b110 && com31_25 == 0b0000000) return OR;     // 0000 0000            110       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b111 && com31_25 == 0b0000000) return AND;    // 0000 0000            111       011 0011
-  if (com19_0 == 0b00000000000000001111 && com31_28 == 0b0000) return FENCE;            // 0000           0000 0000 0000 0000 1111
-  if (command == 0b00000000000000000001000000001111) return FENCE_I;                    // 0000 0000 0000 0000 0001 0000 0000 1111
-  if (command == 0b00000000000000000000000001110011) return ECALL;                      // 0000 0000 0000 0000 0000 0000 0111 0011
-  if (command == 0b00000000000100000000000001110011) return EBREAK;                     // 0000 0000 0001 0000 0000 0000 0111 0011
-  if (com6_0 == 0b1110011 && com14_12 == 0b001) return CSRRW;                           //                      001       111 0011
-  if (com6_0 == 0b1110011 && com14_12 == 0b010) return CSRRS;                           //                      010       111 0011
-  if (com6_0 == 0b1110011 && com14_12 == 0b011) return CSRRC;                           //                      011       111 0011
-  if (com6_0 == 0b1110011 && com14_12 == 0b101) return CSRRWI;                          //                      101       111 0011
-  if (com6_0 == 0b1110011 && com14_12 == 0b110) return CSRRSI;                          //                      110       111 0011
-  if (com6_0 == 0b1110011 && com14_12 == 0b111) return CSRRCI;                          //                      111       111 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b000 && com31_25 == 0b0000001) return MUL;    // 0000 001             000       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b001 && com31_25 == 0b0000001) return MULH;   // 0000 001             001       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b010 && com31_25 == 0b0000001) return MULHSU; // 0000 001             010       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b011 && com31_25 == 0b0000001) return MULHU;  // 0000 001             011       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b100 && com31_25 == 0b0000001) return DIV;    // 0000 001             100       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b101 && com31_25 == 0b0000001) return DIVU;   // 0000 001             101       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b110 && com31_25 == 0b0000001) return REM;    // 0000 001             110       011 0011
-  if (com6_0 == 0b0110011 && com14_12 == 0b111 && com31_25 == 0b0000001) return REMU;   // 0000 001             111       011 0011
-  return UNKNOWN;
-}
-
-
 const char section_name[] = {0x2e, 0x74, 0x65, 0x78, 0x74, 0x00}; // .text
 const unsigned long int section_name_length = 6;
 
 FILE *input;
+FILE *second_input;     // the new file of --diff
+FILE *trace_input;      // the PCs of --trace
+
+// Error messages go straight to stdout, except on --batch workers: those point
+// error_message at a buffer of their current file so that the message can be
+// reported together with the file name once the batch is done.
+#define ERROR_MESSAGE_SIZE 160
+
+__thread char *error_message;
+
+void report_error(const char *format, ...) {
+  va_list arguments;
+  va_start(arguments, format);
+  if (error_message) {
+    vsnprintf(error_message, ERROR_MESSAGE_SIZE, format, arguments);
+  } else {
+    vprintf(format, arguments);
+  }
+  va_end(arguments);
+}
+
+// Counted for --stats, see below
+static inline void *counted_malloc(size_t size);
+static inline void  counted_free(void *pointer);
+
+// Memory of one input: the image of a piped file, the labels and their names,
+// the chunk table, the decode arrays and the output buffer are all carved from
+// an arena. Between inputs the arena is reset rather than freed; after a reset
+// it is a single block as large as everything the last input took together,
+// so later inputs of a similar size make no allocator calls at all and memory
+// stays at what the largest input needed.
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t              size;       // bytes of data after the header
+  size_t              used;
+  size_t              padding;    // keeps the data 16-byte aligned, like malloc()
+} arena_block;
+
+typedef struct {
+  arena_block *blocks;            // the one being carved first
+  size_t       reserve;           // size of the first block after a reset
+} arena;
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+static inline size_t arena_round(size_t size) {
+  return (size + 15) & ~(size_t) 15;
+}
+
+void *arena_alloc(arena *memory, size_t size) {
+  size = arena_round(size);
+  arena_block *block = memory->blocks;
+  if (!block || block->size - block->used < size) {
+    // Blocks at least double, so an input that outgrows the arena adds only a few
+    size_t block_size = block ? 2 * block->size : memory->reserve;
+    if (block_size < ARENA_BLOCK_SIZE) block_size = ARENA_BLOCK_SIZE;
+    if (block_size < size) block_size = size;
+    block = counted_malloc(sizeof(arena_block) + block_size);
+    if (!block) return NULL;
+    block->next = memory->blocks;
+    block->size = block_size;
+    block->used = 0;
+    memory->blocks = block;
+  }
+  void *data = (char *) (block + 1) + block->used;
+  block->used += size;
+  return data;
+}
+
+// Like realloc() for memory from the arena: the last allocation grows in place
+// when its block has room, anything else is copied and its old bytes stay
+// unused until the reset
+void *arena_grow(arena *memory, void *data, size_t size, size_t new_size) {
+  arena_block *block = memory->blocks;
+  if (data && block && (char *) data + arena_round(size) == (char *) (block + 1) + block->used &&
+      block->size - block->used + arena_round(size) >= arena_round(new_size)) {
+    block->used += arena_round(new_size) - arena_round(size);
+    return data;
+  }
+  void *grown = arena_alloc(memory, new_size);
+  if (grown && data) memcpy(grown, data, size < new_size ? size : new_size);
+  return grown;
+}
+
+// Bytes the arena holds, used or not
+size_t arena_size(const arena *memory) {
+  size_t size = 0;
+  for (arena_block *block = memory->blocks; block; block = block->next) size += block->size;
+  return size;
+}
+
+void arena_release(arena *memory) {
+  while (memory->blocks) {
+    arena_block *next = memory->blocks->next;
+    counted_free(memory->blocks);
+    memory->blocks = next;
+  }
+}
+
+// Makes all of the arena free for the next input
+void arena_reset(arena *memory) {
+  if (memory->blocks && !memory->blocks->next) {
+    memory->blocks->used = 0;
+    return;
+  }
+  memory->reserve = arena_size(memory);
+  arena_release(memory);
+}
+
+int arena_decoded(decoded_instructions *decoded, size_t capacity, arena *memory) {
+  void *data = arena_alloc(memory, decoded_size(capacity));
+  if (!data) return 1;
+  place_decoded(decoded, data, capacity);
+  return 0;
+}
 
 typedef struct {
   uint8_t     e_ident[16];
@@ -226,26 +185,184 @@ typedef struct {
   uint16_t    st_shndx;
 } symtab_entry;
 
-int check_header(elf_header *header) {
+// Function labels sorted by address, built once per file so that the main loop
+// can walk them together with the instruction stream. The "<name>" strings are
+// formatted up front into one pool and shared by every instruction that uses them.
+typedef struct {
+  uint32_t    address;
+  uint32_t    order;        // position in .symtab, the last one wins for equal addresses
+  uint32_t    name;         // offset of "<name>" in label_index.pool
+} label_entry;
+
+typedef struct {
+  label_entry *entries;
+  uint32_t     count;
+  char        *pool;
+} label_index;
+
+int compare_labels(const void *a, const void *b) {
+  const label_entry *x = a;
+  const label_entry *y = b;
+  if (x->address != y->address) return x->address < y->address ? -1 : 1;
+  return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// The index lives in `memory` until its next reset
+int build_label_index(label_index *index, const symtab_entry *symbols, uint32_t symbols_count,
+                      const uint8_t *strtab, uint32_t strtab_size, arena *memory) {
+  index->entries = NULL;
+  index->count = 0;
+  index->pool = NULL;
+
+  uint32_t count = 0;
+  size_t pool_size = 0;
+  for (uint32_t k = 0; k < symbols_count; k++) {
+    if ((symbols[k].st_info & 0xf) != 2 || symbols[k].st_name >= strtab_size) continue;
+    count++;
+    pool_size += strnlen((char *) strtab + symbols[k].st_name, strtab_size - symbols[k].st_name) + 3;
+  }
+  if (count == 0) return 0;
+
+  index->entries = arena_alloc(memory, count * sizeof(label_entry));
+  index->pool = arena_alloc(memory, pool_size);
+  if (!index->entries || !index->pool) {
+    index->entries = NULL;
+    index->pool = NULL;
+    return 0xa110c;
+  }
+
+  size_t used = 0;
+  for (uint32_t k = 0; k < symbols_count; k++) {
+    if ((symbols[k].st_info & 0xf) != 2 || symbols[k].st_name >= strtab_size) continue;
+    const char *name = (const char *) strtab + symbols[k].st_name;
+    size_t length = strnlen(name, strtab_size - symbols[k].st_name);
+    label_entry *entry = &index->entries[index->count++];
+    entry->address = symbols[k].st_value;
+    entry->order = k;
+    entry->name = used;
+    index->pool[used++] = '<';
+    memcpy(index->pool + used, name, length);
+    used += length;
+    index->pool[used++] = '>';
+    index->pool[used++] = 0;
+  }
+  qsort(index->entries, index->count, sizeof(label_entry), compare_labels);
+
+  uint32_t unique = 0;
+  for (uint32_t k = 0; k < index->count; k++) {
+    if (k + 1 < index->count && index->entries[k + 1].address == index->entries[k].address) continue;
+    index->entries[unique++] = index->entries[k];
+  }
+  index->count = unique;
+  return 0;
+}
+
+int check_header(const elf_header *header) {
   if (header->e_ident[0] != 0x7f || 
       header->e_ident[1] != 'E'  ||
       header->e_ident[2] != 'L'  ||
       header->e_ident[3] != 'F') {
-      printf("Magic numbers are wrong for ELF file format");
+      report_error("Magic numbers are wrong for ELF file format");
       return 0xe1f;
   } else if (header->e_ident[4] != 1) {
-      printf("ELF format should be 32bit");
+      report_error("ELF format should be 32bit");
       return 0x32b17;
   } else if (header->e_ident[5] != 1) {
-      printf("ELF format should be Little Endian");
+      report_error("ELF format should be Little Endian");
       return 0x11771e;
   } else if (header->e_machine != 0xf3) {
-      printf("ELF format should be RISC-V");
+      report_error("ELF format should be RISC-V");
       return 0x415c;
   }
   return 0;
 }
 
+// The whole input as one read-only block. Regular files are mapped, anything
+// that cannot be mapped (pipes, character devices) is read into the arena of the
+// input. Headers and sections are handed out as views into that block and are
+// only valid until release_image() and the arena's reset.
+typedef struct {
+  const uint8_t        *data;
+  size_t                size;
+  int                   mapped;
+  const elf_header     *header;
+  const section_header *sections;
+} elf_image;
+
+int read_whole_stream(elf_image *image, FILE *file, arena *memory) {
+  size_t capacity = 1 << 16;
+  size_t size = 0;
+  uint8_t *buffer = arena_alloc(memory, capacity);
+  while (buffer) {
+    size += fread(buffer + size, 1, capacity - size, file);
+    if (size < capacity) break;
+    buffer = arena_grow(memory, buffer, capacity, 2 * capacity);
+    capacity *= 2;
+  }
+  if (!buffer || ferror(file)) {
+    report_error("Input file could not be read");
+    return 0x4ead;
+  }
+  image->data = buffer;
+  image->size = size;
+  image->mapped = false;
+  return 0;
+}
+
+// Returns the bytes of section `index`, or NULL when the section does not lie
+// inside the file or is not aligned for `alignment`-byte access.
+const uint8_t *section_view(const elf_image *image, uint32_t index, uint32_t alignment) {
+  if (index >= image->header->e_shnum) return NULL;
+  const section_header *section = &image->sections[index];
+  if (section->sh_offset > image->size || section->sh_size > image->size - section->sh_offset) return NULL;
+  if (section->sh_offset % alignment != 0) return NULL;
+  return image->data + section->sh_offset;
+}
+
+// A file that cannot be mapped is read into `memory`
+int load_image(elf_image *image, FILE *file, arena *memory) {
+  struct stat info;
+  image->data = NULL;
+  image->header = NULL;
+  image->sections = NULL;
+  if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (data != MAP_FAILED) {
+      image->data = data;
+      image->size = info.st_size;
+      image->mapped = true;
+    }
+  }
+  if (!image->data) {
+    int error = read_whole_stream(image, file, memory);
+    if (error != 0) return error;
+  }
+
+  if (image->size < sizeof(elf_header)) {
+    report_error("Input file is too small for an ELF header");
+    return 0x5a11;
+  }
+  image->header = (const elf_header *) image->data;
+  int error = check_header(image->header);
+  if (error != 0) return error;
+
+  const elf_header *header = image->header;
+  if (header->e_shoff > image->size ||
+      (uint64_t) header->e_shnum * sizeof(section_header) > image->size - header->e_shoff ||
+      header->e_shoff % 4 != 0 ||
+      header->e_shstrndx >= header->e_shnum) {
+    report_error("Section header table is out of the file bounds");
+    return 0x5ec7;
+  }
+  image->sections = (const section_header *) (image->data + header->e_shoff);
+  return 0;
+}
+
+void release_image(elf_image *image) {
+  if (image->data && image->mapped) munmap((void *) image->data, image->size);
+  image->data = NULL;
+}
+
 int extend_sign(uint32_t num, int bits) {
   return - (num & (1 << bits)) + (num & ((1 << bits) - 1));
 }
@@ -254,327 +371,3510 @@ int close_files(){
   if (input) {
     fclose(input);
   }
+  if (second_input) {
+    fclose(second_input);
+  }
+  if (trace_input) {
+    fclose(trace_input);
+  }
   return 1;
 }
 
+// The part of .text to show. Kept apart from the other options because a
+// --serve request brings its own.
+typedef struct {
+  char    *symbol;       // --symbol: only this function
+  int      ranged;       // --range: only addresses [range_start, range_end)
+  uint32_t range_start;
+  uint32_t range_end;
+  int      addressed;    // --address: only the function containing `address`
+  uint32_t address;
+} range_query;
+
+typedef struct {
+  int      jobs;
+  int      raw;          // input is a bare stream of instruction words, not an ELF file
+  uint32_t base;         // address of the first word in --raw mode
+  int      rvc;          // decode RVC even if the ELF flags do not ask for it, always needed for --raw
+  char    *batch;        // list file or directory of inputs for --batch
+  char    *out_dir;      // where --batch writes its outputs
+  char    *cache;        // directory of the output cache, NULL without --cache
+  uint64_t cache_size;   // bytes the cache may take before old entries are evicted
+  int      binary;       // --format=bin: records as in bin_format.h instead of text
+  range_query query;    // --symbol, --range or --address
+  int      stats;        // --stats: report phase times and counts to stderr
+  int      stats_json;   // ... as JSON
+  int      annotate;     // --annotate: show branch and jump targets as <func+0x1c>
+  int      histogram;    // --histogram: count instructions instead of showing them
+  int      histogram_json;   // ... as JSON rather than CSV
+  int      by_function;  // ... for every function as well as the total
+  char    *trace;        // --trace: file of PCs to annotate with their lines
+  int      diff;         // --diff: compare the functions of two ELF files
+  char    *diff_paths[2];   // ... the old one and the new one
+  char    *serve;        // --serve: socket to answer disassembly requests on
+  uint64_t serve_size;   // bytes the parsed images of --serve may take
+  char    *connect;      // --connect: socket of a --serve process to ask instead
+  char    *input_path;   // ... about this file
+} dis_options;
+
+dis_options options = {.jobs = 1, .cache_size = 1ULL << 30, .serve_size = 1ULL << 30};
+
+// How a file got its output
+enum { CACHE_OFF, CACHE_HIT, CACHE_MISS };
+
+// --stats: time spent per phase, summed over the threads that ran it. Each
+// phase is timed around a whole chunk, block or file, never per instruction,
+// so the clocks cost nothing measurable; with --stats off they are not read.
+enum { PHASE_LOAD, PHASE_SYMBOLS, PHASE_DECODE, PHASE_FORMAT, PHASE_WRITE, PHASE_COUNT };
+
+const char *phase_names[PHASE_COUNT] = {"load", "symbols", "decode", "format", "write"};
+
+typedef struct {
+  uint64_t wall_ns[PHASE_COUNT];
+  uint64_t cpu_ns[PHASE_COUNT];
+  uint64_t instructions;
+  uint64_t text_bytes;
+  uint64_t output_bytes;
+  uint64_t allocations;       // counted_malloc, counted_calloc and counted_strdup calls
+  uint64_t reallocations;
+  uint64_t frees;
+} run_stats;
+
+run_stats stats;
+
+typedef struct {
+  uint64_t wall;
+  uint64_t cpu;
+} phase_clock;
+
+static inline uint64_t clock_ns(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline void count_stat(uint64_t *counter, uint64_t amount) {
+  if (options.stats) __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+// Writes the clock even with --stats off, so that no caller reads it uninitialized
+static inline void start_phase(phase_clock *clock) {
+  if (!options.stats) {
+    *clock = (phase_clock) {0};
+    return;
+  }
+  clock->wall = clock_ns(CLOCK_MONOTONIC);
+  clock->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static inline void end_phase(phase_clock *clock, int phase) {
+  if (!options.stats) return;
+  count_stat(&stats.wall_ns[phase], clock_ns(CLOCK_MONOTONIC) - clock->wall);
+  count_stat(&stats.cpu_ns[phase], clock_ns(CLOCK_THREAD_CPUTIME_ID) - clock->cpu);
+}
+
+// With --stats the allocations of the tool itself are counted: arena blocks,
+// output buffers, the cache, diff, batch and server tables. Allocations made
+// inside libc or libdecoder.a are not
+static inline void *counted_malloc(size_t size) {
+  count_stat(&stats.allocations, 1);
+  return malloc(size);
+}
+
+static inline void *counted_calloc(size_t count, size_t size) {
+  count_stat(&stats.allocations, 1);
+  return calloc(count, size);
+}
+
+static inline void *counted_realloc(void *pointer, size_t size) {
+  count_stat(&stats.reallocations, 1);
+  return realloc(pointer, size);
+}
+
+static inline char *counted_strdup(const char *text) {
+  count_stat(&stats.allocations, 1);
+  return strdup(text);
+}
+
+static inline void counted_free(void *pointer) {
+  if (pointer) count_stat(&stats.frees, 1);
+  free(pointer);
+}
+
+void print_usage(char *program) {
+  printf("usage: %s [--jobs N] [--rvc] [--raw [--base ADDR]] <input|-> [output]\n", program);
+  printf("       %s [--jobs N] [--rvc] [--raw [--base ADDR]] --batch <list|dir> --out-dir DIR\n", program);
+  printf("       either with [--format=text|bin] [--cache DIR [--cache-size BYTES[K|M|G]]]\n");
+  printf("       and for ELF files [--symbol NAME | --range START-END | --address ADDR]\n");
+  printf("       and for ELF files [--annotate] to show branch targets\n");
+  printf("       or for ELF files [--histogram[=csv|json] [--by-function]] to count instructions instead\n");
+  printf("       --stats[=json] reports where the time went on stderr\n");
+  printf("       %s [--rvc] --diff <old> <new> [output] compares the functions of two builds\n", program);
+  printf("       %s [--rvc] --trace <pcfile|-> <input> [output] shows the line and function of every PC\n", program);
+  printf("       %s [--jobs N] [--rvc] [--annotate] [--format=text|bin] --serve SOCKET [--serve-size BYTES[K|M|G]]\n",
+         program);
+  printf("       %s --connect SOCKET [--symbol NAME | --range START-END | --address ADDR] <input> [output]\n", program);
+}
+
+// Accepts decimal, 0x-prefixed hex and 0-prefixed octal like strtoul()
+int parse_address(char *value, uint32_t *address) {
+  char *end;
+  errno = 0;
+  unsigned long long number = strtoull(value, &end, 0);
+  if (*value == 0 || *end != 0 || errno != 0 || number > UINT32_MAX) return false;
+  *address = number;
+  return true;
+}
+
+// A byte count with an optional K, M or G suffix
+int parse_size(char *value, uint64_t *size) {
+  char *end;
+  errno = 0;
+  unsigned long long number = strtoull(value, &end, 10);
+  int shift = 0;
+  if (*end == 'K' || *end == 'k') shift = 10;
+  if (*end == 'M' || *end == 'm') shift = 20;
+  if (*end == 'G' || *end == 'g') shift = 30;
+  if (shift) end++;
+  if (*value == 0 || *end != 0 || errno != 0 || number > (UINT64_MAX >> shift)) return false;
+  *size = (uint64_t) number << shift;
+  return true;
+}
+
+// START-END, both addresses as for parse_address(), END excluded
+int parse_range(char *value, uint32_t *start, uint32_t *end) {
+  char *dash = strchr(value, '-');
+  if (!dash) return false;
+  *dash = 0;
+  int valid = parse_address(value, start) && parse_address(dash + 1, end) && *start < *end;
+  *dash = '-';
+  return valid;
+}
+
+// Reads the value of an option given either as "--name value" or "--name=value"
+char *option_value(int argc, char **argv, int *i, char *name) {
+  size_t length = strlen(name);
+  if (strncmp(argv[*i], name, length) != 0) return NULL;
+  if (argv[*i][length] == '=') return argv[*i] + length + 1;
+  if (argv[*i][length] == 0 && *i + 1 < argc) return argv[++*i];
+  return NULL;
+}
+
 int open_files(int argc, char **argv) {
-  if (argc == 2 || argc == 3) {
-    char* input_name = argv[1];
-    input = fopen(input_name, "rb");
-    if (!input) {
-        printf("Input file is unreachable");
-        return 0x1f;
+  char *names[3];
+  int names_count = 0;
+  for (int i = 1; i < argc; i++) {
+    char *value;
+    if ((value = option_value(argc, argv, &i, "--jobs"))) {
+      char *end;
+      long jobs = strtol(value, &end, 10);
+      if (*end != 0 || jobs < 0 || jobs > 1024) {
+        print_usage(argv[0]);
+        return 0xdead;
+      }
+      // --jobs 0 picks one job per online core
+      options.jobs = jobs == 0 ? sysconf(_SC_NPROCESSORS_ONLN) : jobs;
+    } else if (!strcmp(argv[i], "--raw")) {
+      options.raw = true;
+    } else if (!strcmp(argv[i], "--rvc")) {
+      options.rvc = true;
+    } else if ((value = option_value(argc, argv, &i, "--batch"))) {
+      options.batch = value;
+    } else if ((value = option_value(argc, argv, &i, "--out-dir"))) {
+      options.out_dir = value;
+    } else if ((value = option_value(argc, argv, &i, "--cache-size"))) {
+      if (!parse_size(value, &options.cache_size)) {
+        print_usage(argv[0]);
+        return 0xdead;
+      }
+    } else if ((value = option_value(argc, argv, &i, "--cache"))) {
+      options.cache = value;
+    } else if (!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--stats=json")) {
+      options.stats = true;
+      options.stats_json = argv[i][7] == '=';
+    } else if (!strcmp(argv[i], "--histogram") || !strcmp(argv[i], "--histogram=csv") ||
+               !strcmp(argv[i], "--histogram=json")) {
+      options.histogram = true;
+      options.histogram_json = !strcmp(argv[i], "--histogram=json");
+    } else if ((value = option_value(argc, argv, &i, "--trace"))) {
+      options.trace = value;
+    } else if (!strcmp(argv[i], "--by-function")) {
+      options.by_function = true;
+    } else if (!strcmp(argv[i], "--annotate")) {
+      options.annotate = true;
+    } else if (!strcmp(argv[i], "--diff")) {
+      options.diff = true;
+    } else if ((value = option_value(argc, argv, &i, "--symbol"))) {
+      options.query.symbol = value;
+    } else if ((value = option_value(argc, argv, &i, "--range"))) {
+      if (!parse_range(value, &options.query.range_start, &options.query.range_end)) {
+        print_usage(argv[0]);
+        return 0xdead;
+      }
+      options.query.ranged = true;
+    } else if ((value = option_value(argc, argv, &i, "--address"))) {
+      if (!parse_address(value, &options.query.address)) {
+        print_usage(argv[0]);
+        return 0xdead;
+      }
+      options.query.addressed = true;
+    } else if ((value = option_value(argc, argv, &i, "--serve-size"))) {
+      if (!parse_size(value, &options.serve_size)) {
+        print_usage(argv[0]);
+        return 0xdead;
+      }
+    } else if ((value = option_value(argc, argv, &i, "--serve"))) {
+      options.serve = value;
+    } else if ((value = option_value(argc, argv, &i, "--connect"))) {
+      options.connect = value;
+    } else if ((value = option_value(argc, argv, &i, "--format"))) {
+      if (strcmp(value, "bin") && strcmp(value, "text")) {
+        print_usage(argv[0]);
+        return 0xdead;
+      }
+      options.binary = !strcmp(value, "bin");
+    } else if ((value = option_value(argc, argv, &i, "--base"))) {
+      if (!parse_address(value, &options.base)) {
+        print_usage(argv[0]);
+        return 0xdead;
+      }
+    } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+      print_usage(argv[0]);
+      return 0xdead;
+    } else if (names_count < 3) {
+      names[names_count++] = argv[i];
+    } else {
+      print_usage(argv[0]);
+      return 0xdead;
     }
-    if (argc == 3) {
-        char* output_name = argv[2];
-        freopen(output_name, "w", stdout);
-    }
-    return 0;
   }
-  else{
-    printf("usage: %s <input> [output]\n", argv[0]);
+  // --batch takes its inputs from the list and needs somewhere to put the outputs
+  // --symbol, --range and --annotate need the ELF symbols and addresses, which a raw stream does not have
+  // --diff takes two ELF files, and writes text of its own
+  // --serve takes its inputs from the requests, --connect leaves everything but the query to the server
+  // --histogram counts the instructions of ELF files and writes a report instead of any disassembly
+  // --trace annotates the PCs of one ELF file with lines of its own
+  int selected = (options.query.symbol != NULL) + options.query.ranged + options.query.addressed;
+  if ((options.batch != NULL) != (options.out_dir != NULL) || (options.batch && names_count > 0) ||
+      selected > 1 || (options.raw && (selected || options.annotate)) ||
+      names_count > (options.diff ? 3 : 2) || (options.diff && (names_count < 2 || options.batch || options.raw ||
+      options.binary || selected || options.annotate || options.cache)) ||
+      (options.serve && (names_count > 0 || options.batch || options.raw || options.diff || options.connect ||
+      selected || options.cache || options.stats)) ||
+      (options.connect && (names_count < 1 || options.batch || options.raw || options.diff || options.binary ||
+      options.annotate || options.rvc || options.cache || options.stats)) ||
+      (options.by_function && !options.histogram) || (options.histogram && (options.raw || options.binary ||
+      options.annotate || options.cache || options.diff || options.serve || options.connect)) ||
+      (options.trace && (options.batch || options.raw || options.binary || selected || options.annotate ||
+      options.cache || options.diff || options.serve || options.connect || options.histogram))) {
+    print_usage(argv[0]);
+    return 0xdead;
+  }
+  if (options.cache && mkdir(options.cache, 0755) != 0 && errno != EEXIST) {
+    report_error("Cache directory could not be created");
+    return 0xcac4e;
+  }
+  if (options.batch || options.serve) return 0;
+  if (names_count == 0) {
+    print_usage(argv[0]);
     return 0xdead;
   }
+  // The server opens the file itself
+  if (options.connect) {
+      options.input_path = names[0];
+      if (names_count == 2) freopen(names[1], "w", stdout);
+      return 0;
+  }
+
+  input = strcmp(names[0], "-") ? fopen(names[0], "rb") : stdin;
+  if (!input) {
+      report_error("Input file is unreachable");
+      return 0x1f;
+  }
+  if (options.trace) {
+      trace_input = strcmp(options.trace, "-") ? fopen(options.trace, "rb") : stdin;
+      if (!trace_input || trace_input == input) {
+          report_error("Trace file is unreachable");
+          return 0x1f;
+      }
+  }
+  if (options.diff) {
+      options.diff_paths[0] = names[0];
+      options.diff_paths[1] = names[1];
+      second_input = strcmp(names[1], "-") ? fopen(names[1], "rb") : stdin;
+      if (!second_input || second_input == input) {
+          report_error("Input file is unreachable");
+          return 0x1f;
+      }
+  }
+  if (names_count == (options.diff ? 3 : 2)) {
+      freopen(names[names_count - 1], "w", stdout);
+  }
+  return 0;
+}
+
+// Text of one run of instructions. Chunks are formatted into their own buffer
+// so that they can be produced on any thread and written out in address order.
+typedef struct {
+  char   *data;
+  size_t  length;
+  size_t  capacity;
+  int     failed;
+  arena  *memory;       // grows in here when set, on the heap otherwise
+} output_buffer;
+
+int reserve_output(output_buffer *out, size_t extra) {
+  if (out->length + extra <= out->capacity) return true;
+  size_t capacity = out->capacity ? out->capacity : 4096;
+  while (capacity < out->length + extra) capacity *= 2;
+  char *data = out->memory ? arena_grow(out->memory, out->data, out->capacity, capacity) : counted_realloc(out->data, capacity);
+  if (!data) {
+    out->failed = true;
+    return false;
+  }
+  out->data = data;
+  out->capacity = capacity;
+  return true;
+}
+
+const uint8_t register_lengths[] = {4, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+                                    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 2, 2, 2, 2};
+
+const char hex_digits[] = "0123456789abcdef";
+
+// Room for everything on a line except the label and the mnemonic
+#define LINE_RESERVE 96
+
+// The put_* helpers append without checking the capacity, begin_line() reserves
+// enough for a whole line up front
+void put_char(output_buffer *out, char c) {
+  out->data[out->length++] = c;
+}
+
+void put_string(output_buffer *out, const char *text, size_t length) {
+  memcpy(out->data + out->length, text, length);
+  out->length += length;
+}
+
+void put_register(output_buffer *out, uint32_t index) {
+  put_string(out, registers[index], register_lengths[index]);
+}
+
+void put_unsigned(output_buffer *out, uint64_t value) {
+  char digits[20];
+  int count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (count) put_char(out, digits[--count]);
+}
+
+void put_signed(output_buffer *out, int64_t value) {
+  if (value < 0) {
+    put_char(out, '-');
+    put_unsigned(out, -(uint64_t) value);
+  } else {
+    put_unsigned(out, value);
+  }
 }
 
+// Same as "%08x"
+void put_address(output_buffer *out, uint32_t value) {
+  char *end = out->data + out->length + 8;
+  for (int i = 1; i <= 8; i++) {
+    end[-i] = hex_digits[value & 0xf];
+    value >>= 4;
+  }
+  out->length += 8;
+}
+
+// Writes "%08x: <label>\t\t", returns false when there is no memory for the line
+int begin_line(output_buffer *out, uint32_t current_offset, const char *label, size_t label_length, size_t extra) {
+  if (!reserve_output(out, label_length + extra + LINE_RESERVE)) return false;
+  put_address(out, current_offset);
+  put_string(out, ": ", 2);
+  put_string(out, label, label_length);
+  put_string(out, "\t\t", 2);
+  return true;
+}
+
+typedef struct command_descriptor command_descriptor;
+
+// Writes the line of one instruction. Every routine takes all the fields and
+// uses those of its format.
+typedef int (*show_function)(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1,
+                             uint32_t rs2, int32_t imm, uint32_t current_offset, const char *label);
+
+// How an enum Command is shown: its mnemonic, the routine for its line and the
+// flags that routine takes. `brackets` shows loads and stores as offset(base),
+// `sign` shows the immediate field sign-extended from its bit 11.
+struct command_descriptor {
+  const char   *name;
+  uint8_t       name_length;
+  uint8_t       brackets;
+  uint8_t       sign;
+  show_function show;
+};
+
+// Writes "%08x: <label>\t\t<name> \t", the start of every line with operands
+int begin_instruction(output_buffer *out, uint32_t current_offset, const char *label,
+                      const command_descriptor *command) {
+  size_t label_length = strlen(label);
+  if (!begin_line(out, current_offset, label, label_length, command->name_length)) return false;
+  put_string(out, command->name, command->name_length);
+  put_string(out, " \t", 2);
+  return true;
+}
 
-int show_u_type(char* name, int command, int current_offset, char* label, int sign) {
-   int64_t imm = get_slice(command, 31, 12);                       // xxxx xxxx xxxx xxxx xxxx ____ ____ ____
-   uint32_t rd  = get_slice(command, 11, 7);                       // ____ ____ ____ ____ ____ xxxx x___ ____
-   if (sign) imm = extend_sign(imm, 11);
-   printf("%08x: %s\t\t%s \t%s, %ld\n", current_offset, label, name, registers[rd], imm);
+int show_u_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                int32_t imm, uint32_t current_offset, const char *label) {
+   (void) rs1; (void) rs2;
+   int64_t shown = (uint32_t) imm >> 12;                           // xxxx xxxx xxxx xxxx xxxx ____ ____ ____
+   if (command->sign) shown = extend_sign(shown, 11);
+   if (!begin_instruction(out, current_offset, label, command)) return false;
+   put_register(out, rd);
+   put_string(out, ", ", 2);
+   put_signed(out, shown);
+   put_char(out, '\n');
+   return true;
 }
 
-int show_j_type(char* name, int command, int current_offset, char* label, int sign) {
-   uint32_t imm20    = get_slice(command, 31, 31);                 // x___ ____ ____ ____ ____ ____ ____ ____
-   uint32_t imm10_1  = get_slice(command, 30, 21);                 // _xxx xxxx xxx_ ____ ____ ____ ____ ____
-   uint32_t imm11    = get_slice(command, 20, 20) ;                // ____ ____ ___x ____ ____ ____ ____ ____
-   uint32_t imm19_12 = get_slice(command, 19, 12);                 // ____ ____ ____ xxxx xxxx ____ ____ ____ 
-   int64_t imm = (imm20 << 20) + (imm19_12 << 12) + (imm11 << 11) + (imm10_1 << 1);
-   uint32_t rd       = get_slice(command, 11, 7);                  // ____ ____ ____ ____ ____ xxxx x___ ____
-   if (sign) imm = extend_sign(imm, 11);
-   printf("%08x: %s\t\t%s \t%s, %ld\n", current_offset, label, name, registers[rd], imm);
+int show_j_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                int32_t imm, uint32_t current_offset, const char *label) {
+   (void) rs1; (void) rs2;
+   int64_t shown = imm & 0x1fffff;                                 // imm[20:1] as it is laid out in the word
+   if (command->sign) shown = extend_sign(shown, 11);
+   if (!begin_instruction(out, current_offset, label, command)) return false;
+   put_register(out, rd);
+   put_string(out, ", ", 2);
+   put_signed(out, shown);
+   put_char(out, '\n');
+   return true;
 }
 
-int show_i_type(char* name, int command, int current_offset, char* label, int brackets, int sign) {
-   int64_t imm  = get_slice(command, 31, 20);                      // xxxx xxxx xxxx ____ ____ ____ ____ ____
-   uint32_t rs1 = get_slice(command, 19, 15);                      // ____ ____ ____ xxxx x___ ____ ____ ____
-   uint32_t rd  = get_slice(command, 11, 7);                       // ____ ____ ____ ____ ____ xxxx x___ ____
-   if (sign) imm = extend_sign(imm, 11);
-   if (brackets) {
-   	printf("%08x: %s\t\t%s \t%s, %ld(%s)\n", current_offset, label, name, registers[rd], imm, registers[rs1]);
+int show_i_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                int32_t imm, uint32_t current_offset, const char *label) {
+   (void) rs2;
+   int64_t shown = imm & 0xfff;                                    // imm[11:0]
+   if (command->sign) shown = extend_sign(shown, 11);
+   if (!begin_instruction(out, current_offset, label, command)) return false;
+   put_register(out, rd);
+   put_string(out, ", ", 2);
+   if (command->brackets) {
+     put_signed(out, shown);
+     put_char(out, '(');
+     put_register(out, rs1);
+     put_string(out, ")\n", 2);
    } else {
-	printf("%08x: %s\t\t%s \t%s, %s, %ld\n", current_offset, label, name, registers[rd], registers[rs1], imm);
+     put_register(out, rs1);
+     put_string(out, ", ", 2);
+     put_signed(out, shown);
+     put_char(out, '\n');
    }
+   return true;
+}
+
+int show_b_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                int32_t imm, uint32_t current_offset, const char *label) {
+   (void) rd;
+   int64_t shown = imm & 0x1fff;                                   // imm[12:1]
+   if (command->sign) shown = extend_sign(shown, 11);
+   if (!begin_instruction(out, current_offset, label, command)) return false;
+   put_register(out, rs1);
+   put_string(out, ", ", 2);
+   put_register(out, rs2);
+   put_string(out, ", ", 2);
+   put_signed(out, shown);
+   put_char(out, '\n');
+   return true;
 }
 
-int show_b_type(char* name, int command, int current_offset, char* label, int sign) {
-   uint32_t imm12   = get_slice(command, 31, 31);                  // x___ ____ ____ ____ ____ ____ ____ ____
-   uint32_t imm10_5 = get_slice(command, 30, 25);                  // _xxx xxx_ ____ ____ ____ ____ ____ ____
-   uint32_t rs2     = get_slice(command, 24, 20);                  // ____ ___x xxxx ____ ____ ____ ____ ____
-   uint32_t rs1     = get_slice(command, 19, 15);                  // ____ ____ ____ xxxx x___ ____ ____ ____
-   uint32_t imm4_1  = get_slice(command, 11, 8);                   // ____ ____ ____ ____ ____ xxxx ____ ____
-   uint32_t imm11   = get_slice(command, 7, 7);                    // ____ ____ ____ ____ ____ ____ x___ ____
-   int64_t imm      = (imm12 << 12) + (imm11 << 11) + (imm10_5 << 5) + (imm4_1 << 1);
-   if (sign) imm = extend_sign(imm, 11);
-   printf("%08x: %s\t\t%s \t%s, %s, %ld\n", current_offset, label, name, registers[rs1], registers[rs2], imm);
-}
-
-int show_s_type(char* name, int command, int current_offset, char* label, int brackets, int sign) {
-   uint32_t imm11_5 = get_slice(command, 31, 25);                  // xxxx xxx_ ____ ____ ____ ____ ____ ____
-   uint32_t rs2     = get_slice(command, 24, 20);                  // ____ ___x xxxx ____ ____ ____ ____ ____
-   uint32_t rs1     = get_slice(command, 19, 15);                  // ____ ____ ____ xxxx x___ ____ ____ ____
-   uint32_t imm4_0  = get_slice(command, 11, 7);                   // ____ ____ ____ ____ ____ xxxx x___ ____
-   int64_t imm      = (imm11_5 << 5) + imm4_0;
-   if (sign) imm = extend_sign(imm, 11);
-   if (brackets) {
-   	printf("%08x: %s\t\t%s \t%s, %ld(%s)\n", current_offset, label, name, registers[rs2], imm, registers[rs1]);
+int show_s_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                int32_t imm, uint32_t current_offset, const char *label) {
+   (void) rd;
+   int64_t shown = imm & 0xfff;                                    // imm[11:0]
+   if (command->sign) shown = extend_sign(shown, 11);
+   if (!begin_instruction(out, current_offset, label, command)) return false;
+   if (command->brackets) {
+     put_register(out, rs2);
+     put_string(out, ", ", 2);
+     put_signed(out, shown);
+     put_char(out, '(');
+     put_register(out, rs1);
+     put_string(out, ")\n", 2);
    } else {
-	printf("%08x: %s\t\t%s \t%s, %s, %ld\n", current_offset, label, name, registers[rs1], registers[rs2], imm);
+     put_register(out, rs1);
+     put_string(out, ", ", 2);
+     put_register(out, rs2);
+     put_string(out, ", ", 2);
+     put_signed(out, shown);
+     put_char(out, '\n');
    }
-   
+   return true;
 }
 
-int show_r_type(char* name, int command, int current_offset, char* label) {
-   uint32_t rs2     = get_slice(command, 24, 20);                  // ____ ___x xxxx ____ ____ ____ ____ ____
-   uint32_t rs1     = get_slice(command, 19, 15);                  // ____ ____ ____ xxxx x___ ____ ____ ____
-   uint32_t rd  = get_slice(command, 11, 7);                       // ____ ____ ____ ____ ____ xxxx x___ ____
-   printf("%08x: %s\t\t%s \t%s, %s, %s\n", current_offset, label, name, registers[rd], registers[rs1], registers[rs2]);
+int show_r_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                int32_t imm, uint32_t current_offset, const char *label) {
+   (void) imm;
+   if (!begin_instruction(out, current_offset, label, command)) return false;
+   put_register(out, rd);
+   put_string(out, ", ", 2);
+   put_register(out, rs1);
+   put_string(out, ", ", 2);
+   put_register(out, rs2);
+   put_char(out, '\n');
+   return true;
 }
 
-int show_shamt_type(char* name, int command, int current_offset, char* label, int sign) {
-   int64_t shamt = get_slice(command, 24, 20);                   // ____ ___x xxxx ____ ____ ____ ____ ____
-   uint32_t rs1  = get_slice(command, 19, 15);                   // ____ ____ ____ xxxx x___ ____ ____ ____
-   uint32_t rd   = get_slice(command, 11, 7);                    // ____ ____ ____ ____ ____ xxxx x___ ____
-   if (sign) shamt = extend_sign(shamt, 11);
-   printf("%08x: %s\t\t%s \t%s, %s, %ld\n", current_offset, label, name, registers[rd], registers[rs1], shamt);
+int show_shamt_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                    int32_t imm, uint32_t current_offset, const char *label) {
+   (void) rs2;
+   int64_t shamt = imm;
+   if (command->sign) shamt = extend_sign(shamt, 11);
+   if (!begin_instruction(out, current_offset, label, command)) return false;
+   put_register(out, rd);
+   put_string(out, ", ", 2);
+   put_register(out, rs1);
+   put_string(out, ", ", 2);
+   put_signed(out, shamt);
+   put_char(out, '\n');
+   return true;
 }
 
-int show_fence_type(char* name, int command, int current_offset, char* label) {
-   uint32_t pred = get_slice(command, 27, 24);                     // ____ xxxx ____ ____ ____ ____ ____ ____ 
-   uint32_t succ = get_slice(command, 23, 20);                     // ____ ____ xxxx ____ ____ ____ ____ ____
-   printf("%08x: %s\t\t%s \t%u, %u", current_offset, label,  name, pred, succ);
+int show_plain_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                    int32_t imm, uint32_t current_offset, const char *label) {
+   (void) rd; (void) rs1; (void) rs2; (void) imm;
+   size_t label_length = strlen(label);
+   if (!begin_line(out, current_offset, label, label_length, command->name_length)) return false;
+   put_string(out, command->name, command->name_length);
+   put_char(out, '\n');
+   return true;
 }
 
-int show_csr_type(char* name, int command, int current_offset, char* label) {
-   uint32_t rs1 = get_slice(command, 19, 15);                  // ____ ____ ____ xxxx x___ ____ ____ ____
-   uint32_t rd  = get_slice(command, 11, 7);                   // ____ ____ ____ ____ ____ xxxx x___ ____
-   uint32_t csr = get_slice(command, 31, 20);                  // xxxx xxxx xxxx ____ ____ ____ ____ ____
-   printf("%08x: %s\t\t%s \t%s, %u, %s", current_offset, label, name, registers[rd], csr, registers[rs1]);
+int show_unknown(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                 int32_t imm, uint32_t current_offset, const char *label) {
+   (void) command; (void) rd; (void) rs1; (void) rs2; (void) imm;
+   size_t label_length = strlen(label);
+   if (!reserve_output(out, label_length + LINE_RESERVE)) return false;
+   put_address(out, current_offset);
+   put_string(out, ": <", 3);
+   put_string(out, label, label_length);
+   put_string(out, ">\tUNKNOWN\n", 10);
+   return true;
 }
 
-int show_csr_zimm_type(char* name, int command, int current_offset, char* label) {
-   uint32_t zimm = get_slice(command, 19, 15);                 // ____ ____ ____ xxxx x___ ____ ____ ____
-   uint32_t rd  = get_slice(command, 11, 7);                   // ____ ____ ____ ____ ____ xxxx x___ ____
-   uint32_t csr = get_slice(command, 31, 20);                  // xxxx xxxx xxxx ____ ____ ____ ____ ____
-   printf("%08x: %s\t\t%s \t%s, %u, %u", current_offset, label, name, registers[rd], csr, zimm);
+int show_fence_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                    int32_t imm, uint32_t current_offset, const char *label) {
+   (void) rd; (void) rs1; (void) rs2;
+   uint32_t pred = get_slice(imm, 7, 4);                           // ____ xxxx ____ of fm:pred:succ
+   uint32_t succ = get_slice(imm, 3, 0);                           // ____ ____ xxxx
+   if (!begin_instruction(out, current_offset, label, command)) return false;
+   put_unsigned(out, pred);
+   put_string(out, ", ", 2);
+   put_unsigned(out, succ);
+   return true;
 }
 
-int main(int argc, char **argv) {
-  if (open_files(argc, argv) != 0){
-     return close_files();
-  }
-
-  elf_header header;
-  fread(&header, 1, sizeof(header), input);
-  if (check_header(&header) != 0){
-     return close_files();
-  }
-  
-  fseek(input, header.e_shoff, SEEK_SET);
-  section_header section_headers[header.e_shnum];
-  fread(section_headers, header.e_shnum, sizeof(section_header), input);
-
-  fseek(input, section_headers[header.e_shstrndx].sh_offset, SEEK_SET);
-  uint8_t section_names[section_headers[header.e_shstrndx].sh_size];
-  fread(section_names, section_headers[header.e_shstrndx].sh_size, sizeof(uint8_t), input);
-  
-  int section_index;
-  int symtab_index;
-  int strtab_index;
-  for (int i = 0; i < header.e_shnum; i++) {
-     int link = section_headers[i].sh_name;
-     char buffer[section_name_length];
-     for(int p = 0; p < section_name_length; p++){
-        buffer[p] = 0;
-     }
+int show_csr_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t rs1, uint32_t rs2,
+                  int32_t csr, uint32_t current_offset, const char *label) {
+   (void) rs2;
+   if (!begin_instruction(out, current_offset, label, command)) return false;
+   put_register(out, rd);
+   put_string(out, ", ", 2);
+   put_unsigned(out, csr);
+   put_string(out, ", ", 2);
+   put_register(out, rs1);
+   return true;
+}
 
-     int j = 0;
-     while(section_names[link] != 0x00) {
-        buffer[j++] = section_names[link++];
-	if (j == section_name_length){
-	  break;
-	}
-     }
-     
-     if (!strncmp(section_name, buffer, section_name_length)) {
-       section_index = i;  
-     }
-     if (section_headers[i].sh_type == 0x2) {
-       symtab_index = i;
-     }
-     if (section_headers[i].sh_type == 0x3) {
-       strtab_index = i;
-     }
+// rs1 holds the 5-bit zimm
+int show_csr_zimm_type(output_buffer *out, const command_descriptor *command, uint32_t rd, uint32_t zimm,
+                       uint32_t rs2, int32_t csr, uint32_t current_offset, const char *label) {
+   (void) rs2;
+   if (!begin_instruction(out, current_offset, label, command)) return false;
+   put_register(out, rd);
+   put_string(out, ", ", 2);
+   put_unsigned(out, csr);
+   put_string(out, ", ", 2);
+   put_unsigned(out, zimm);
+   return true;
+}
+
+#define MNEMONIC(text) text, sizeof(text) - 1
+
+// One row per enum Command; an instruction added to the decoder is shown once
+// it has a row here
+const command_descriptor command_descriptors[UNKNOWN + 1] = {
+  [LUI]     = {MNEMONIC("lui"),     false, true,  show_u_type},
+  [AUIPC]   = {MNEMONIC("auipc"),   false, true,  show_u_type},
+  [JAL]     = {MNEMONIC("jal"),     false, true,  show_j_type},
+  [JALR]    = {MNEMONIC("jalr"),    false, true,  show_i_type},
+  [BEQ]     = {MNEMONIC("beq"),     false, true,  show_b_type},
+  [BNE]     = {MNEMONIC("bne"),     false, true,  show_b_type},
+  [BLT]     = {MNEMONIC("blt"),     false, true,  show_b_type},
+  [BGE]     = {MNEMONIC("bge"),     false, true,  show_b_type},
+  [BLTU]    = {MNEMONIC("bltu"),    false, true,  show_b_type},
+  [BGEU]    = {MNEMONIC("bgeu"),    false, true,  show_b_type},
+  [LB]      = {MNEMONIC("lb"),      true,  true,  show_i_type},
+  [LH]      = {MNEMONIC("lh"),      true,  true,  show_i_type},
+  [LW]      = {MNEMONIC("lw"),      true,  true,  show_i_type},
+  [LBU]     = {MNEMONIC("lbu"),     true,  true,  show_i_type},
+  [LHU]     = {MNEMONIC("lhu"),     true,  true,  show_i_type},
+  [SB]      = {MNEMONIC("sb"),      true,  true,  show_s_type},
+  [SH]      = {MNEMONIC("sh"),      true,  true,  show_s_type},
+  [SW]      = {MNEMONIC("sw"),      true,  true,  show_s_type},
+  [ADDI]    = {MNEMONIC("addi"),    false, true,  show_i_type},
+  [SLTI]    = {MNEMONIC("slti"),    false, true,  show_i_type},
+  [SLTIU]   = {MNEMONIC("sltiu"),   false, false, show_i_type},
+  [XORI]    = {MNEMONIC("xori"),    false, true,  show_i_type},
+  [ORI]     = {MNEMONIC("ori"),     false, true,  show_i_type},
+  [ANDI]    = {MNEMONIC("andi"),    false, true,  show_i_type},
+  [SLLI]    = {MNEMONIC("slli"),    false, false, show_shamt_type},
+  [SRLI]    = {MNEMONIC("srli"),    false, false, show_shamt_type},
+  [SRAI]    = {MNEMONIC("srai"),    false, true,  show_shamt_type},
+  [ADD]     = {MNEMONIC("add"),     false, false, show_r_type},
+  [SUB]     = {MNEMONIC("sub"),     false, false, show_r_type},
+  [SLL]     = {MNEMONIC("sll"),     false, false, show_r_type},
+  [SLT]     = {MNEMONIC("slt"),     false, false, show_r_type},
+  [SLTU]    = {MNEMONIC("sltu"),    false, false, show_r_type},
+  [XOR]     = {MNEMONIC("xor"),     false, false, show_r_type},
+  [SRL]     = {MNEMONIC("srl"),     false, false, show_r_type},
+  [SRA]     = {MNEMONIC("sra"),     false, false, show_r_type},
+  [OR]      = {MNEMONIC("or"),      false, false, show_r_type},
+  [AND]     = {MNEMONIC("and"),     false, false, show_r_type},
+  [FENCE]   = {MNEMONIC("fence"),   false, false, show_fence_type},
+  [FENCE_I] = {MNEMONIC("fence.i"), false, false, show_plain_type},
+  [ECALL]   = {MNEMONIC("ecall"),   false, false, show_plain_type},
+  [EBREAK]  = {MNEMONIC("ebreak"),  false, false, show_plain_type},
+  [CSRRW]   = {MNEMONIC("csrrw"),   false, false, show_csr_type},
+  [CSRRS]   = {MNEMONIC("csrrs"),   false, false, show_csr_type},
+  [CSRRC]   = {MNEMONIC("csrrc"),   false, false, show_csr_type},
+  [CSRRWI]  = {MNEMONIC("csrrwi"),  false, false, show_csr_zimm_type},
+  [CSRRSI]  = {MNEMONIC("csrrsi"),  false, false, show_csr_zimm_type},
+  [CSRRCI]  = {MNEMONIC("csrrci"),  false, false, show_csr_zimm_type},
+  [MUL]     = {MNEMONIC("mul"),     false, false, show_r_type},
+  [MULH]    = {MNEMONIC("mulh"),    false, false, show_r_type},
+  [MULHSU]  = {MNEMONIC("mulhsu"),  false, false, show_r_type},
+  [MULHU]   = {MNEMONIC("mulhu"),   false, false, show_r_type},
+  [DIV]     = {MNEMONIC("div"),     false, false, show_r_type},
+  [DIVU]    = {MNEMONIC("divu"),    false, false, show_r_type},
+  [REM]     = {MNEMONIC("rem"),     false, false, show_r_type},
+  [REMU]    = {MNEMONIC("remu"),    false, false, show_r_type},
+  [UNKNOWN] = {MNEMONIC("unknown"), false, false, show_unknown},
+};
+
+// Index of the first label at or after `address`
+uint32_t find_label(const label_index *labels, uint32_t address) {
+  uint32_t low = 0;
+  uint32_t high = labels->count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (labels->entries[middle].address < address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
   }
+  return low;
+}
 
-  uint32_t section_offset = section_headers[section_index].sh_offset;
-  uint32_t section_size = section_headers[section_index].sh_size / 4;
-  uint32_t section_address = section_headers[section_index].sh_addr;
-  fseek(input, section_offset, SEEK_SET);
-  uint32_t assembler_commands[section_size];
-  fread(assembler_commands, section_size, sizeof(uint32_t), input);
-  
-  uint32_t symtab_offset = section_headers[symtab_index].sh_offset;
-  uint32_t symtab_size = section_headers[symtab_index].sh_size / 16;
-  uint32_t symtab_address = section_headers[symtab_index].sh_addr;
-  fseek(input, symtab_offset, SEEK_SET);
-  symtab_entry symtab_entries[symtab_size];
-  fread(symtab_entries, symtab_size, sizeof(symtab_entry), input);
-
-  fseek(input, section_headers[strtab_index].sh_offset, SEEK_SET);
-  uint8_t strtab[section_headers[strtab_index].sh_size];
-  fread(strtab, section_headers[strtab_index].sh_size, sizeof(uint8_t), input);
-
-  for (int i = 0; i < section_size; i++) {
-    enum Command command = get_command(assembler_commands[i]);
-    int cmd = assembler_commands[i];
-    uint32_t current_offset = section_address + i * 4; 
-    int length = -1;
-    char* label;
-    for (int k = 0; k < symtab_size; k++) {
-		if ((current_offset == symtab_entries[k].st_value) && ((symtab_entries[k].st_info & 0xf) == 2)) {     
-		  int link = symtab_entries[k].st_name;
-		  int j = 1;
-		  while(strtab[link++] != 0x00);
-		  length = link - symtab_entries[k].st_name;
-		  label = malloc((length + 2) * sizeof(char));
-		  link = symtab_entries[k].st_name;
-		  label[0] = '<';
-		  while(strtab[link] != 0x00) {	
-			 label[j++] = strtab[link++];
-		  }
-		  label[j] = '>';
-		}
-    }
-     if (length == -1) {
-        label = "";
-     }
-     if (command == LUI) {
-       show_u_type("lui", cmd, current_offset, label, true);	
-     } else if (command == AUIPC) {
-       show_u_type("auipc", cmd, current_offset, label, true);
-     } else if (command == JAL) {
-       show_j_type("jal", cmd, current_offset, label, true);
-     } else if (command == JALR) {
-       show_i_type("jalr", cmd, current_offset, label, false, true);
-     } else if (command == BEQ) {
-       show_b_type("beq", cmd, current_offset, label, true);
-     } else if (command == BNE) {
-       show_b_type("bne", cmd, current_offset, label, true);
-     } else if (command == BLT) {
-       show_b_type("blt", cmd, current_offset, label, true);
-     } else if (command == BGE) {
-       show_b_type("bge", cmd, current_offset, label, true);
-     } else if (command == BLTU) {
-       show_b_type("bltu", cmd, current_offset, label, true);
-     } else if (command == BGEU) {
-       show_b_type("bgeu", cmd, current_offset, label, true);
-     } else if (command == LB) {
-       show_i_type("lb", cmd, current_offset, label, true, true);
-     } else if (command == LH) {
-       show_i_type("lh", cmd, current_offset, label, true, true);
-     } else if (command == LW) {
-       show_i_type("lw", cmd, current_offset, label, true, true);
-     } else if (command == LBU) {
-       show_i_type("lbu", cmd, current_offset, label, true, true);
-     } else if (command == LHU) {
-       show_i_type("lhu", cmd, current_offset, label, true, true);
-     } else if (command == SB) {
-       show_s_type("sb", cmd, current_offset, label, true, true);
-     } else if (command == SH) {
-       show_s_type("sh", cmd, current_offset, label, true, true);
-     } else if (command == SW) {
-       show_s_type("sw", cmd, current_offset, label, true, true);
-     } else if (command == ADDI) {
-       show_i_type("addi", cmd, current_offset, label, false, true);
-     } else if (command == SLTI) {
-       show_i_type("slti", cmd, current_offset, label, false, true);
-     } else if (command == SLTIU) {
-       show_i_type("sltiu", cmd, current_offset, label, false, false);
-     } else if (command == XORI) {
-       show_i_type("xori", cmd, current_offset, label, false, true);
-     } else if (command == ORI) {
-       show_i_type("ori", cmd, current_offset, label, false, true);
-     } else if (command == ANDI) {
-       show_i_type("andi", cmd, current_offset, label, false, true);
-     } else if (command == SLLI) {
-       show_shamt_type("slli", cmd, current_offset, label, false);
-     } else if (command == SRLI) {
-       show_shamt_type("srli", cmd, current_offset, label, false);
-     } else if (command == SRAI) {
-       show_shamt_type("srai", cmd, current_offset, label, true);
-     } else if (command == ADD) {
-       show_r_type("add", cmd, current_offset, label);
-     } else if (command == SUB) {
-       show_r_type("sub", cmd, current_offset, label);
-     } else if (command == SLL) {
-       show_r_type("sll", cmd, current_offset, label);
-     } else if (command == SLT) {
-       show_r_type("slt", cmd, current_offset, label);
-     } else if (command == SLTU) {
-       show_r_type("sltu", cmd, current_offset, label);
-     } else if (command == XOR) {
-       show_r_type("xor", cmd, current_offset, label);
-     } else if (command == SRL) {
-       show_r_type("srl", cmd, current_offset, label);
-     } else if (command == SRA) {
-       show_r_type("sra", cmd, current_offset, label);
-     } else if (command == OR) {
-       show_r_type("or", cmd, current_offset, label);
-     } else if (command == AND) {
-       show_r_type("and", cmd, current_offset, label);
-     } else if (command == FENCE) {
-       show_fence_type("fence", cmd, current_offset, label);
-     } else if (command == FENCE_I) {
-       printf("%08x: %s\t\tfence.i\n", current_offset, label);
-     } else if (command == ECALL) {
-       printf("%08x: %s\t\tecall\n", current_offset, label);
-     } else if (command == EBREAK) {
-       printf("%08x: %s\t\tebreak\n", current_offset, label);
-     } else if (command == CSRRW) {
-       show_csr_type("csrrw", cmd, current_offset, label);
-     } else if (command == CSRRS) {
-       show_csr_type("csrrs", cmd, current_offset, label);
-     } else if (command == CSRRC) {
-       show_csr_type("csrrc", cmd, current_offset, label);
-     } else if (command == CSRRWI) {
-       show_csr_zimm_type("csrrwi", cmd, current_offset, label);
-     } else if (command == CSRRSI) {
-       show_csr_zimm_type("csrrsi", cmd, current_offset, label);
-     } else if (command == CSRRCI) {
-       show_csr_zimm_type("csrrci", cmd, current_offset, label);
-     } else if (command == MUL) {
-       show_r_type("mul", cmd, current_offset, label);
-     } else if (command == MULH) {
-       show_r_type("mulh", cmd, current_offset, label);
-     } else if (command == MULHSU) {
-       show_r_type("mulhsu", cmd, current_offset, label);
-     } else if (command == MULHU) {
-       show_r_type("mulhu", cmd, current_offset, label);
-     } else if (command == DIV) {
-       show_r_type("div", cmd, current_offset, label);
-     } else if (command == DIVU) {
-       show_r_type("divu", cmd, current_offset, label);
-     } else if (command == REM) {
-       show_r_type("rem", cmd, current_offset, label);
-     } else if (command == REMU) {
-       show_r_type("remu", cmd,  current_offset, label);
-     } else {
-       printf("%08x: <%s>\tUNKNOWN\n", current_offset, label);
-     }
+// Instruction bytes to disassemble. With `compressed` set they are walked in
+// 2-byte parcels and may mix RVC and 32-bit instructions, otherwise every
+// instruction is a 32-bit word.
+typedef struct {
+  const uint8_t *bytes;
+  uint32_t       size;
+  uint32_t       address;      // address of bytes[0]
+  int            compressed;
+  uint32_t       section_address;   // the whole .text, which a --symbol or --range view is part of
+  uint32_t       section_size;
+} code_view;
+
+// Decodes the instructions in bytes [start, end) of `code`, as many as fit into
+// `decoded`, and returns their number
+size_t decode_chunk(decoded_instructions *decoded, const code_view *code, uint32_t start, uint32_t end) {
+  if (code->compressed) {
+    size_t parcels;
+    return decode_parcels((const uint16_t *) (code->bytes + start), (end - start) / 2, decoded, &parcels);
+  }
+  size_t count = (end - start) / 4 < decoded->capacity ? (end - start) / 4 : decoded->capacity;
+  decode_instructions((const uint32_t *) (code->bytes + start), count, decoded);
+  return count;
+}
+
+// --annotate: the last AUIPC, whose result a following JALR or ADDI on the same
+// register turns into a full address
+typedef struct {
+  int      valid;
+  uint32_t rd;
+  uint32_t value;
+} auipc_state;
+
+// Whether entry k of `decoded`, at `address`, has a target: the destination of
+// a branch or JAL, or the address an AUIPC+JALR/ADDI pair forms. Call it for
+// every instruction in order so that `auipc` follows along.
+static inline int find_target(const decoded_instructions *decoded, size_t k, uint32_t address, auipc_state *auipc,
+                              uint32_t *target) {
+  enum Command command = decoded->command[k];
+  int found = false;
+  if (command == JAL || (command >= BEQ && command <= BGEU)) {
+    *target = address + decoded->imm[k];
+    found = true;
+  } else if ((command == JALR || command == ADDI) && auipc->valid && decoded->rs1[k] == auipc->rd) {
+    *target = auipc->value + decoded->imm[k];
+    found = true;
+  }
+  auipc->valid = command == AUIPC && decoded->rd[k] != 0;
+  auipc->rd = decoded->rd[k];
+  auipc->value = address + decoded->imm[k];
+  return found;
+}
+
+// --annotate: appends " <func+0x1c>" for `target` to the line just written, by
+// the last label at or before it. Outside of .text only a target right at a
+// label is shown, anything else would just be an offset from the last function
+// of the section. Lines without a trailing newline (fence, csr) are left alone.
+void put_target(output_buffer *out, const code_view *code, const label_index *labels, uint32_t target) {
+  uint32_t next = find_label(labels, target + 1);
+  if (next == 0 || out->failed || out->length == 0 || out->data[out->length - 1] != '\n') return;
+  const label_entry *label = &labels->entries[next - 1];
+  if (label->address != target && target - code->section_address >= code->section_size) return;
+  const char *name = labels->pool + label->name;
+  size_t length = strlen(name);
+  if (!reserve_output(out, length + 16)) return;
+  out->length--;
+  put_char(out, ' ');
+  put_string(out, name, length - 1);
+  uint32_t offset = target - label->address;
+  if (offset != 0) {
+    put_string(out, "+0x", 3);
+    int digits = 1;
+    while (digits < 8 && offset >> (4 * digits)) digits++;
+    for (int i = digits - 1; i >= 0; i--) put_char(out, hex_digits[(offset >> (4 * i)) & 0xf]);
+  }
+  put_string(out, ">\n", 2);
+}
+
+// --format=bin: one bin_record per decoded instruction instead of a line of text.
+// Returns the bytes the instructions took, like disassemble_chunk().
+uint32_t put_records(output_buffer *out, const decoded_instructions *decoded, const code_view *code,
+                     uint32_t start, size_t count, const label_index *labels) {
+  // Without room the records are skipped, write_output() then reports the failure
+  int room = reserve_output(out, count * sizeof(bin_record));
+  uint32_t offset = start;
+  uint32_t next_label = find_label(labels, code->address + start);
+  // An instruction is in the function of the last label at or before it
+  uint32_t symbol = next_label;
+  for (size_t k = 0; k < count; offset += decoded->length[k], k++) {
+    uint32_t address = code->address + offset;
+    while (next_label < labels->count && labels->entries[next_label].address <= address) symbol = ++next_label;
+    if (!room) continue;
+    bin_record record = {
+      .address = address,
+      .imm = decoded->imm[k],
+      .symbol = symbol,
+      .command = decoded->command[k],
+      .format = decoded->format[k],
+      .rd = decoded->rd[k],
+      .rs1 = decoded->rs1[k],
+      .rs2 = decoded->rs2[k],
+      .length = decoded->length[k]
+    };
+    memcpy(&record.word, code->bytes + offset, decoded->length[k]);
+    memcpy(out->data + out->length, &record, sizeof(record));
+    out->length += sizeof(record);
+  }
+  return offset - start;
+}
+
+// Decodes the instructions in bytes [start, end) of `code` into `decoded`, formats
+// the lines from there and returns the number of bytes they took. That is less
+// than end - start when the range ends inside an instruction or `decoded` is full.
+uint32_t disassemble_chunk(output_buffer *out, decoded_instructions *decoded, const code_view *code,
+                           uint32_t start, uint32_t end, const label_index *labels) {
+  phase_clock clock;
+  start_phase(&clock);
+  size_t count = decode_chunk(decoded, code, start, end);
+  end_phase(&clock, PHASE_DECODE);
+  count_stat(&stats.instructions, count);
+
+  start_phase(&clock);
+  if (options.binary) {
+    uint32_t used = put_records(out, decoded, code, start, count, labels);
+    end_phase(&clock, PHASE_FORMAT);
+    return used;
+  }
+  uint32_t current_offset = code->address + start;
+  uint32_t next_label = find_label(labels, current_offset);
+  auipc_state auipc = {false};
+  if (options.annotate && !code->compressed && start >= 4) {
+    // An AUIPC at the end of the previous chunk still pairs with the first instruction here. Compressed chunks
+    // never start after an AUIPC, see plan_chunks()
+    uint32_t previous;
+    memcpy(&previous, code->bytes + start - 4, 4);
+    if (get_command(previous) == AUIPC) {
+      auipc = (auipc_state) {get_slice(previous, 11, 7) != 0, get_slice(previous, 11, 7),
+                             current_offset - 4 + get_immediate(previous, FORMAT_U)};
+    }
+  }
+  for (uint32_t k = 0; k < count; current_offset += decoded->length[k], k++) {
+    uint32_t rd  = decoded->rd[k];
+    uint32_t rs1 = decoded->rs1[k];
+    uint32_t rs2 = decoded->rs2[k];
+    int32_t  imm = decoded->imm[k];
+    const char *label = "";
+    while (next_label < labels->count && labels->entries[next_label].address < current_offset) {
+      next_label++;
+    }
+    if (next_label < labels->count && labels->entries[next_label].address == current_offset) {
+      label = labels->pool + labels->entries[next_label].name;
+    }
+    const command_descriptor *command = &command_descriptors[decoded->command[k]];
+    command->show(out, command, rd, rs1, rs2, imm, current_offset, label);
+    // --diff compares whole lines, so fence and csr get the newline they otherwise lack
+    if (options.diff && !out->failed && out->data[out->length - 1] != '\n' && reserve_output(out, 1)) put_char(out, '\n');
+    uint32_t target;
+    if (options.annotate && find_target(decoded, k, current_offset, &auipc, &target)) put_target(out, code, labels, target);
+  }
+  end_phase(&clock, PHASE_FORMAT);
+  return current_offset - code->address - start;
+}
+
+// Instructions per chunk handed to a worker
+#define CHUNK_SIZE 65536
+
+// Byte offsets in `code` where each chunk starts, followed by the end of the
+// last whole instruction. Compressed code has to be walked once to find the
+// boundaries, 32-bit code just steps by CHUNK_SIZE words. Returns the number of
+// chunks, or -1 when there is no memory; *instruction_count gets the total.
+// A compressed chunk that would start right after an AUIPC starts at the AUIPC
+// instead, so that --annotate sees the pair in one chunk; with 32-bit code
+// disassemble_chunk() looks back at the previous word.
+int plan_chunks(const code_view *code, uint32_t **chunk_starts, uint32_t *instruction_count, arena *memory) {
+  uint32_t limit = code->compressed ? code->size / 2 : code->size / 4;
+  // Compressed chunks may be one instruction short
+  uint32_t *starts = arena_alloc(memory, (limit / (CHUNK_SIZE - 1) + 2) * sizeof(uint32_t));
+  if (!starts) return -1;
+  int chunks = 0;
+  uint32_t offset = 0;
+  if (code->compressed) {
+    const uint16_t *parcels = (const uint16_t *) code->bytes;
+    uint32_t instructions = 0;
+    uint32_t in_chunk = CHUNK_SIZE;
+    uint32_t auipc = UINT32_MAX;   // offset of the previous instruction when it is an AUIPC
+    while (offset + 2 <= code->size) {
+      uint32_t length = parcels_of(parcels[offset / 2]) * 2;
+      if (offset + length > code->size) break;
+      if (in_chunk == CHUNK_SIZE) {
+        in_chunk = 0;
+        if (auipc != UINT32_MAX && chunks > 0 && starts[chunks - 1] != auipc) {
+          starts[chunks++] = auipc;
+          in_chunk = 1;
+        } else {
+          starts[chunks++] = offset;
+        }
+      }
+      auipc = length == 4 && (parcels[offset / 2] & 0x7f) == 0x17 ? offset : UINT32_MAX;
+      in_chunk++;
+      instructions++;
+      offset += length;
+    }
+    *instruction_count = instructions;
+  } else {
+    for (; offset < limit * 4; offset += CHUNK_SIZE * 4) starts[chunks++] = offset;
+    offset = limit * 4;
+    *instruction_count = limit;
+  }
+  starts[chunks] = offset;
+  *chunk_starts = starts;
+  return chunks;
+}
+
+// Workers claim chunks in address order and format each into a slot of a small
+// ring. The main thread writes the slots out in the same order, so at most
+// `slot_count` formatted chunks are held in memory at any time.
+typedef struct {
+  output_buffer        out;
+  decoded_instructions decoded;
+  int                  ready;
+} chunk_slot;
+
+typedef struct {
+  pthread_mutex_t    lock;
+  pthread_cond_t     changed;
+  const code_view   *code;
+  const uint32_t    *chunk_starts;
+  const label_index *labels;
+  uint32_t           chunk_count;
+  uint32_t           next_chunk;
+  uint32_t           written;
+  chunk_slot        *slots;
+  uint32_t           slot_count;
+} chunk_queue;
+
+void *disassemble_worker(void *argument) {
+  chunk_queue *queue = argument;
+  pthread_mutex_lock(&queue->lock);
+  while (true) {
+    while (queue->next_chunk < queue->chunk_count && queue->next_chunk >= queue->written + queue->slot_count) {
+      pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    if (queue->next_chunk >= queue->chunk_count) break;
+    uint32_t chunk = queue->next_chunk++;
+    chunk_slot *slot = &queue->slots[chunk % queue->slot_count];
+    pthread_mutex_unlock(&queue->lock);
+
+    slot->out.length = 0;
+    disassemble_chunk(&slot->out, &slot->decoded, queue->code, queue->chunk_starts[chunk], queue->chunk_starts[chunk + 1],
+                      queue->labels);
+
+    pthread_mutex_lock(&queue->lock);
+    slot->ready = true;
+    pthread_cond_broadcast(&queue->changed);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
+}
+
+// Where formatted text goes: `fd` is the output and `cache_fd` the --cache entry
+// being written, or -1. A failing cache entry is dropped without an error.
+typedef struct {
+  int fd;
+  int cache_fd;
+} output_target;
+
+int write_bytes(int fd, const char *data, size_t length) {
+  size_t written = 0;
+  while (written < length) {
+    ssize_t count = write(fd, data + written, length - written);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return -1;
+    written += count;
   }
-  close_files();
   return 0;
 }
 
+int write_output(output_target *target, output_buffer *out) {
+  if (out->failed) {
+    report_error("Not enough memory for the output");
+    return 0xa110c;
+  }
+  phase_clock clock;
+  start_phase(&clock);
+  fflush(stdout);
+  if (write_bytes(target->fd, out->data, out->length) != 0) {
+    report_error("Output file could not be written");
+    return 0xf111;
+  }
+  if (target->cache_fd >= 0 && write_bytes(target->cache_fd, out->data, out->length) != 0) {
+    close(target->cache_fd);
+    target->cache_fd = -1;
+  }
+  end_phase(&clock, PHASE_WRITE);
+  count_stat(&stats.output_bytes, out->length);
+  return 0;
+}
+
+// The part of a --format=bin file before the records: header, symbols and names
+int write_bin_header(output_target *target, const label_index *labels, uint32_t record_count, uint32_t flags,
+                     arena *memory) {
+  uint32_t strings_size = 0;
+  for (uint32_t k = 0; k < labels->count; k++) {
+    // The pool holds "<name>", the file just the name
+    strings_size += strlen(labels->pool + labels->entries[k].name) - 1;
+  }
+  bin_header header = {
+    .version = BIN_VERSION,
+    .record_size = sizeof(bin_record),
+    .flags = flags,
+    .record_count = record_count,
+    .symbol_count = labels->count,
+    .symbols_offset = sizeof(bin_header),
+    .strings_offset = sizeof(bin_header) + labels->count * sizeof(bin_symbol),
+    .strings_size = strings_size
+  };
+  memcpy(header.magic, BIN_MAGIC, sizeof(header.magic));
+  header.records_offset = (header.strings_offset + strings_size + 7) & ~7u;
+
+  output_buffer out = {.memory = memory};
+  if (reserve_output(&out, header.records_offset)) {
+    memset(out.data, 0, header.records_offset);
+    memcpy(out.data, &header, sizeof(header));
+    uint32_t name = 0;
+    for (uint32_t k = 0; k < labels->count; k++) {
+      const char *label = labels->pool + labels->entries[k].name;
+      size_t length = strlen(label) - 2;
+      bin_symbol symbol = {labels->entries[k].address, name};
+      memcpy(out.data + header.symbols_offset + k * sizeof(bin_symbol), &symbol, sizeof(symbol));
+      memcpy(out.data + header.strings_offset + name, label + 1, length);
+      name += length + 1;
+    }
+    out.length = header.records_offset;
+  }
+  return write_output(target, &out);
+}
+
+int disassemble_section(const code_view *code, const label_index *labels, int jobs, output_target *target,
+                        arena *memory) {
+  uint32_t *chunk_starts;
+  uint32_t instruction_count;
+  int chunk_count = plan_chunks(code, &chunk_starts, &instruction_count, memory);
+  if (chunk_count < 0) {
+    report_error("Not enough memory for the chunk table");
+    return 0xa110c;
+  }
+  if (options.binary) {
+    int error = write_bin_header(target, labels, instruction_count, code->compressed ? BIN_COMPRESSED : 0, memory);
+    if (error != 0) return error;
+  }
+  chunk_queue queue = {
+    .code = code,
+    .chunk_starts = chunk_starts,
+    .labels = labels,
+    .chunk_count = chunk_count
+  };
+  int error = 0;
+  if (jobs <= 1 || queue.chunk_count <= 1) {
+    // The output buffer is the last thing taken from the arena, so it grows in place
+    output_buffer out = {.memory = memory};
+    decoded_instructions decoded;
+    if (arena_decoded(&decoded, CHUNK_SIZE, memory) != 0) {
+      report_error("Not enough memory for the decoded instructions");
+      return 0xa110c;
+    }
+    for (uint32_t chunk = 0; chunk < queue.chunk_count && error == 0; chunk++) {
+      out.length = 0;
+      disassemble_chunk(&out, &decoded, code, chunk_starts[chunk], chunk_starts[chunk + 1], labels);
+      error = write_output(target, &out);
+    }
+    return error;
+  }
+
+  // The slot buffers grow on the worker threads, which do not share the arena
+  uint32_t worker_count = (uint32_t) jobs < queue.chunk_count ? (uint32_t) jobs : queue.chunk_count;
+  queue.slot_count = 2 * worker_count;
+  queue.slots = arena_alloc(memory, queue.slot_count * sizeof(chunk_slot));
+  pthread_t *workers = arena_alloc(memory, worker_count * sizeof(pthread_t));
+  uint32_t allocated = 0;
+  if (queue.slots) memset(queue.slots, 0, queue.slot_count * sizeof(chunk_slot));
+  while (queue.slots && allocated < queue.slot_count &&
+         arena_decoded(&queue.slots[allocated].decoded, CHUNK_SIZE, memory) == 0) {
+    allocated++;
+  }
+  if (!queue.slots || !workers || allocated < queue.slot_count) {
+    report_error("Not enough memory for the worker pool");
+    return 0xa110c;
+  }
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.changed, NULL);
+  uint32_t started = 0;
+  while (started < worker_count && pthread_create(&workers[started], NULL, disassemble_worker, &queue) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    // No thread could be started, so format the chunks here instead
+    queue.slot_count = 1;
+  }
+
+  for (uint32_t chunk = 0; chunk < queue.chunk_count; chunk++) {
+    chunk_slot *slot = &queue.slots[chunk % queue.slot_count];
+    if (started == 0) {
+      queue.next_chunk++;
+      slot->out.length = 0;
+      disassemble_chunk(&slot->out, &slot->decoded, code, chunk_starts[chunk], chunk_starts[chunk + 1], labels);
+      slot->ready = true;
+    }
+    pthread_mutex_lock(&queue.lock);
+    while (!slot->ready) pthread_cond_wait(&queue.changed, &queue.lock);
+    pthread_mutex_unlock(&queue.lock);
+
+    if (error == 0) error = write_output(target, &slot->out);
+
+    pthread_mutex_lock(&queue.lock);
+    slot->ready = false;
+    queue.written++;
+    pthread_cond_broadcast(&queue.changed);
+    pthread_mutex_unlock(&queue.lock);
+  }
+
+  for (uint32_t i = 0; i < started; i++) pthread_join(workers[i], NULL);
+  for (uint32_t i = 0; i < allocated; i++) counted_free(queue.slots[i].out.data);
+  pthread_mutex_destroy(&queue.lock);
+  pthread_cond_destroy(&queue.changed);
+  return error;
+}
+
+// Instruction words read at a time in --raw mode
+#define RAW_BLOCK_SIZE 4096
+
+// Disassembles a headerless stream of little-endian instructions as they arrive.
+// Every read is decoded and written out before the next one, so memory use does
+// not depend on the input size and a pipe produces output as soon as it has data.
+int disassemble_stream(FILE *file, uint32_t base_address, int compressed, int fd, arena *memory) {
+  uint32_t block[RAW_BLOCK_SIZE];
+  label_index no_labels = {0};
+  output_target target = {fd, -1};
+  decoded_instructions decoded;
+  if (arena_decoded(&decoded, RAW_BLOCK_SIZE * 2, memory) != 0) {
+    report_error("Not enough memory for the decoded instructions");
+    return 0xa110c;
+  }
+
+  // The length of a stream is not known up front, so its records run to the end of the file
+  int error = 0;
+  if (options.binary) {
+    error = write_bin_header(&target, &no_labels, 0, BIN_UNSIZED | (compressed ? BIN_COMPRESSED : 0), memory);
+  }
+  output_buffer out = {.memory = memory};
+  size_t pending = 0;
+  uint32_t address = base_address;
+  while (error == 0) {
+    ssize_t count = read(fileno(file), (uint8_t *) block + pending, sizeof(block) - pending);
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0) {
+      report_error("Input file could not be read");
+      error = 0x4ead;
+    }
+    if (count <= 0) break;
+    pending += count;
+    count_stat(&stats.text_bytes, count);
+    // The block is all of the section there is
+    code_view code = {
+      .bytes = (const uint8_t *) block,
+      .size = pending,
+      .address = address,
+      .compressed = compressed,
+      .section_address = address,
+      .section_size = pending
+    };
+
+    out.length = 0;
+    uint32_t used = disassemble_chunk(&out, &decoded, &code, 0, pending, &no_labels);
+    if (used == 0) continue;
+    error = write_output(&target, &out);
+    address += used;
+    // An instruction split across reads is completed by the next one, a trailing partial one is dropped
+    pending -= used;
+    memmove(block, (uint8_t *) block + used, pending);
+  }
+  return error;
+}
+
+// On-disk cache of whole outputs (--cache DIR). An entry is the text for one
+// .text section, stored as DIR/<key>.txt where the key hashes everything the
+// text depends on: the section bytes and address, the labels, the decode mode
+// and cache_version. A repeat run with an unchanged key copies the entry to the
+// output instead of disassembling. Entries are written under a temporary name
+// and renamed when complete, so concurrent runs never see a partial one, and the
+// least recently used ones are removed once the directory outgrows --cache-size.
+
+// Bump whenever the text produced for the same input changes, so that entries
+// written by older versions stop matching
+const char cache_version[] = "dis-cache-1";
+
+#define HASH_PRIME_1 0x9e3779b185ebca87ULL
+#define HASH_PRIME_2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME_3 0x165667b19e3779f9ULL
+#define HASH_PRIME_4 0x85ebca77c2b2ae63ULL
+#define HASH_PRIME_5 0x27d4eb2f165667c5ULL
+
+static inline uint64_t rotate_left(uint64_t value, int bits) {
+  return value << bits | value >> (64 - bits);
+}
+
+static inline uint64_t hash_round(uint64_t accumulator, uint64_t input) {
+  return rotate_left(accumulator + input * HASH_PRIME_2, 31) * HASH_PRIME_1;
+}
+
+static inline uint64_t read_64(const uint8_t *bytes) {
+  uint64_t value;
+  memcpy(&value, bytes, 8);
+  return value;
+}
+
+// XXH64 of `size` bytes: four independent lanes over 32-byte stripes, so it
+// runs at close to memory speed on large sections
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed) {
+  const uint8_t *bytes = data;
+  const uint8_t *end = bytes + size;
+  uint64_t hash;
+  if (size >= 32) {
+    uint64_t lanes[4] = {seed + HASH_PRIME_1 + HASH_PRIME_2, seed + HASH_PRIME_2, seed, seed - HASH_PRIME_1};
+    for (; end - bytes >= 32; bytes += 32) {
+      for (int k = 0; k < 4; k++) lanes[k] = hash_round(lanes[k], read_64(bytes + 8 * k));
+    }
+    hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+    for (int k = 0; k < 4; k++) hash = (hash ^ hash_round(0, lanes[k])) * HASH_PRIME_1 + HASH_PRIME_4;
+  } else {
+    hash = seed + HASH_PRIME_5;
+  }
+  hash += size;
+  for (; end - bytes >= 8; bytes += 8) {
+    hash = rotate_left(hash ^ hash_round(0, read_64(bytes)), 27) * HASH_PRIME_1 + HASH_PRIME_4;
+  }
+  if (end - bytes >= 4) {
+    uint32_t word;
+    memcpy(&word, bytes, 4);
+    hash = rotate_left(hash ^ word * HASH_PRIME_1, 23) * HASH_PRIME_2 + HASH_PRIME_3;
+    bytes += 4;
+  }
+  for (; bytes < end; bytes++) hash = rotate_left(hash ^ *bytes * HASH_PRIME_5, 11) * HASH_PRIME_1;
+  hash ^= hash >> 33;
+  hash *= HASH_PRIME_2;
+  hash ^= hash >> 29;
+  hash *= HASH_PRIME_3;
+  return hash ^ hash >> 32;
+}
+
+uint64_t cache_key(const code_view *code, const label_index *labels) {
+  struct {
+    uint64_t text;
+    uint64_t labels;
+    uint32_t address;
+    uint32_t size;
+    uint32_t compressed;
+    uint32_t binary;
+    uint32_t annotate;
+    uint32_t label_count;
+    char     version[sizeof(cache_version)];
+  } fields;
+  // The padding is hashed too, and an initializer need not clear it
+  memset(&fields, 0, sizeof(fields));
+  fields.text = hash_bytes(code->bytes, code->size, 0);
+  // Only the labels that are shown matter, not the rest of .symtab
+  for (uint32_t k = 0; k < labels->count; k++) {
+    const char *name = labels->pool + labels->entries[k].name;
+    fields.labels = hash_bytes(name, strlen(name), fields.labels ^ labels->entries[k].address);
+  }
+  fields.address = code->address;
+  fields.size = code->size;
+  fields.compressed = code->compressed;
+  fields.binary = options.binary;
+  fields.annotate = options.annotate;
+  fields.label_count = labels->count;
+  memcpy(fields.version, cache_version, sizeof(cache_version));
+  return hash_bytes(&fields, sizeof(fields), 0);
+}
+
+// Path of the entry for `key`, or of the temporary file it is written to first
+char *cache_path(uint64_t key, int temporary) {
+  char *path = counted_malloc(strlen(options.cache) + 32);
+  if (!path) return NULL;
+  if (temporary) {
+    sprintf(path, "%s/.%016llx.XXXXXX", options.cache, (unsigned long long) key);
+  } else {
+    sprintf(path, "%s/%016llx.txt", options.cache, (unsigned long long) key);
+  }
+  return path;
+}
+
+// Copies a cache entry to `fd`. Returns 0 when it was copied and -1 when there
+// is no entry; a failure half way is an error since the output is then partial.
+int copy_cache_entry(uint64_t key, int fd) {
+  char *path = cache_path(key, false);
+  int entry = path ? open(path, O_RDONLY) : -1;
+  counted_free(path);
+  if (entry < 0) return -1;
+  // Reading does not update the mtime, so touch it for the eviction order
+  futimens(entry, NULL);
+
+  phase_clock clock;
+  start_phase(&clock);
+  fflush(stdout);
+  char buffer[1 << 16];
+  int error = 0;
+  for (;;) {
+    ssize_t count = read(entry, buffer, sizeof(buffer));
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0) {
+      report_error("Cache entry could not be read");
+      error = 0xcac4e;
+    }
+    if (count <= 0) break;
+    if (write_bytes(fd, buffer, count) != 0) {
+      report_error("Output file could not be written");
+      error = 0xf111;
+      break;
+    }
+    count_stat(&stats.output_bytes, count);
+  }
+  end_phase(&clock, PHASE_WRITE);
+  close(entry);
+  return error;
+}
+
+typedef struct {
+  char    *name;
+  off_t    size;
+  time_t   used;
+} cache_file;
+
+int compare_cache_files(const void *a, const void *b) {
+  const cache_file *x = a;
+  const cache_file *y = b;
+  return x->used < y->used ? -1 : x->used > y->used;
+}
+
+// Removes the least recently used entries until the cache fits in `max_size` bytes
+void evict_cache(const char *directory_path, uint64_t max_size) {
+  DIR *directory = opendir(directory_path);
+  if (!directory) return;
+  cache_file *files = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  uint64_t total = 0;
+  struct dirent *entry;
+  while ((entry = readdir(directory))) {
+    size_t length = strlen(entry->d_name);
+    // Only finished entries, temporary files may still be in use
+    if (entry->d_name[0] == '.' || length != 20 || strcmp(entry->d_name + 16, ".txt")) continue;
+    struct stat info;
+    if (fstatat(dirfd(directory), entry->d_name, &info, 0) != 0) continue;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      cache_file *grown = counted_realloc(files, capacity * sizeof(cache_file));
+      if (!grown) break;
+      files = grown;
+    }
+    files[count].name = counted_strdup(entry->d_name);
+    if (!files[count].name) break;
+    files[count].size = info.st_size;
+    files[count].used = info.st_mtime;
+    total += info.st_size;
+    count++;
+  }
+  if (total > max_size) {
+    qsort(files, count, sizeof(cache_file), compare_cache_files);
+    for (size_t k = 0; k < count && total > max_size; k++) {
+      if (unlinkat(dirfd(directory), files[k].name, 0) == 0) total -= files[k].size;
+    }
+  }
+  for (size_t k = 0; k < count; k++) counted_free(files[k].name);
+  counted_free(files);
+  closedir(directory);
+}
+
+int compare_addresses(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// --annotate: targets in `code` before the first label (all of them in a
+// stripped file) have nothing to be shown relative to, so they get a local
+// label ".L<address>" of their own. Finding them takes one decode pass over
+// the section ahead of the output; the labels then join the index and are
+// shown like any other.
+int add_local_labels(label_index *labels, const code_view *code, arena *memory) {
+  uint32_t first_label = labels->count ? labels->entries[0].address : UINT32_MAX;
+  uint32_t *chunk_starts;
+  uint32_t instruction_count;
+  int chunk_count = plan_chunks(code, &chunk_starts, &instruction_count, memory);
+  decoded_instructions decoded;
+  if (chunk_count < 0 || arena_decoded(&decoded, CHUNK_SIZE, memory) != 0) {
+    report_error("Not enough memory for the local labels");
+    return 0xa110c;
+  }
+
+  uint32_t *targets = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  int error = 0;
+  auipc_state auipc = {false};
+  for (int chunk = 0; chunk < chunk_count && error == 0; chunk++) {
+    size_t decoded_count = decode_chunk(&decoded, code, chunk_starts[chunk], chunk_starts[chunk + 1]);
+    uint32_t address = code->address + chunk_starts[chunk];
+    for (size_t k = 0; k < decoded_count; address += decoded.length[k], k++) {
+      uint32_t target;
+      if (!find_target(&decoded, k, address, &auipc, &target)) continue;
+      if (target >= first_label || target < code->address || target - code->address >= code->size) continue;
+      if (count == capacity) {
+        size_t grown_capacity = capacity ? capacity * 2 : 256;
+        uint32_t *grown = arena_grow(memory, targets, capacity * sizeof(uint32_t), grown_capacity * sizeof(uint32_t));
+        if (!grown) {
+          error = 0xa110c;
+          break;
+        }
+        targets = grown;
+        capacity = grown_capacity;
+      }
+      targets[count++] = target;
+    }
+  }
+
+  size_t unique = 0;
+  if (error == 0 && count > 0) {
+    qsort(targets, count, sizeof(uint32_t), compare_addresses);
+    for (size_t k = 0; k < count; k++) {
+      if (k == 0 || targets[k] != targets[k - 1]) targets[unique++] = targets[k];
+    }
+    // Names of duplicate symbols stay in the pool, so append after the last one in use
+    size_t pool_size = 0;
+    for (uint32_t k = 0; k < labels->count; k++) {
+      size_t end = labels->entries[k].name + strlen(labels->pool + labels->entries[k].name) + 1;
+      if (end > pool_size) pool_size = end;
+    }
+    // "<.L" + 8 hex digits + ">" and the NUL
+    label_entry *entries = arena_grow(memory, labels->entries, labels->count * sizeof(label_entry),
+                                      (labels->count + unique) * sizeof(label_entry));
+    if (entries) labels->entries = entries;
+    char *pool = entries ? arena_grow(memory, labels->pool, pool_size, pool_size + unique * 13) : NULL;
+    if (!pool) {
+      error = 0xa110c;
+    } else {
+      labels->pool = pool;
+      for (size_t k = 0; k < unique; k++) {
+        label_entry *entry = &labels->entries[labels->count++];
+        entry->address = targets[k];
+        entry->order = 0;
+        entry->name = pool_size;
+        pool_size += sprintf(pool + pool_size, "<.L%x>", targets[k]) + 1;
+      }
+      qsort(labels->entries, labels->count, sizeof(label_entry), compare_labels);
+    }
+  }
+  if (error != 0) report_error("Not enough memory for the local labels");
+  return error;
+}
+
+// Disassembles the section to `fd`, through the cache when there is one
+int disassemble_cached(const code_view *code, const label_index *labels, int jobs, int fd, int *cache_result,
+                       arena *memory) {
+  if (!options.cache) {
+    *cache_result = CACHE_OFF;
+    output_target target = {fd, -1};
+    return disassemble_section(code, labels, jobs, &target, memory);
+  }
+  uint64_t key = cache_key(code, labels);
+  int error = copy_cache_entry(key, fd);
+  if (error >= 0) {
+    *cache_result = CACHE_HIT;
+    return error;
+  }
+
+  *cache_result = CACHE_MISS;
+  char *temporary = cache_path(key, true);
+  output_target target = {fd, temporary ? mkstemp(temporary) : -1};
+  if (target.cache_fd >= 0) fchmod(target.cache_fd, 0644);
+  error = disassemble_section(code, labels, jobs, &target, memory);
+  // A cache that cannot be written only costs the next run a miss
+  if (target.cache_fd >= 0) {
+    char *path = cache_path(key, false);
+    if (close(target.cache_fd) != 0 || error != 0 || !path || rename(temporary, path) != 0) unlink(temporary);
+    counted_free(path);
+  } else if (temporary) {
+    unlink(temporary);
+  }
+  counted_free(temporary);
+  return error;
+}
+
+// A function ends at its st_size, or at the next label when the size is 0
+uint64_t function_end(const symtab_entry *function, const code_view *code, const label_index *labels) {
+  if (function->st_size != 0) return (uint64_t) function->st_value + function->st_size;
+  uint32_t next = find_label(labels, function->st_value + 1);
+  return next < labels->count && labels->entries[next].address > function->st_value ? labels->entries[next].address
+                                                                                      : (uint64_t) code->address + code->size;
+}
+
+// Narrows `code` to the function of --symbol, the function around --address or
+// the addresses of --range in `query`, so that only those bytes are decoded.
+int select_range(const range_query *query, code_view *code, const label_index *labels, const symtab_entry *symbols,
+                 uint32_t symbols_count, const uint8_t *strtab, uint32_t strtab_size) {
+  uint64_t start = query->range_start;
+  uint64_t end = query->range_end;
+  const symtab_entry *found = NULL;
+  if (query->symbol) {
+    size_t length = strlen(query->symbol);
+    // The last one of the name wins, as for labels
+    for (uint32_t k = 0; k < symbols_count; k++) {
+      if ((symbols[k].st_info & 0xf) != 2 || symbols[k].st_name >= strtab_size) continue;
+      if (strtab_size - symbols[k].st_name > length && !memcmp(strtab + symbols[k].st_name, query->symbol, length + 1)) {
+        found = &symbols[k];
+      }
+    }
+    if (!found) {
+      report_error("There is no function named %s", query->symbol);
+      return 0x404;
+    }
+  } else if (query->addressed) {
+    // Of nested functions the innermost one, the one that starts last
+    for (uint32_t k = 0; k < symbols_count; k++) {
+      if ((symbols[k].st_info & 0xf) != 2 || symbols[k].st_value > query->address) continue;
+      if (query->address < function_end(&symbols[k], code, labels) && (!found || symbols[k].st_value >= found->st_value)) {
+        found = &symbols[k];
+      }
+    }
+    if (!found) {
+      report_error("There is no function at 0x%x", query->address);
+      return 0x404;
+    }
+  }
+  if (found) {
+    start = found->st_value;
+    end = function_end(found, code, labels);
+  }
+
+  uint64_t section_end = (uint64_t) code->address + code->size;
+  if (start < code->address) start = code->address;
+  if (end > section_end) end = section_end;
+  if (start >= end) {
+    report_error("The requested addresses are not in .text");
+    return 0x4a9e;
+  }
+  if ((start - code->address) % (code->compressed ? 2 : 4) != 0) {
+    report_error("The requested addresses do not start on an instruction");
+    return 0x4a9e;
+  }
+  code->bytes += start - code->address;
+  code->size = end - start;
+  code->address = start;
+  return 0;
+}
+
+// An ELF file loaded for disassembly: its .text, the function labels and the
+// symbols they came from. Everything points into `image` as in load_image(),
+// or into the arena it was opened with.
+typedef struct {
+  elf_image           image;
+  code_view           code;
+  label_index         labels;
+  const symtab_entry *symbols;
+  uint32_t            symbols_count;
+  const uint8_t      *strtab;
+  uint32_t            strtab_size;
+} elf_input;
+
+void close_elf(elf_input *elf) {
+  release_image(&elf->image);
+}
+
+// Loads `file` and finds its .text and labels. On failure nothing is left to close.
+int open_elf(elf_input *elf, FILE *file, arena *memory) {
+  memset(elf, 0, sizeof(elf_input));
+  phase_clock clock;
+  start_phase(&clock);
+  int error = load_image(&elf->image, file, memory);
+  if (error != 0) {
+     release_image(&elf->image);
+     return error;
+  }
+  const elf_header *header = elf->image.header;
+  const section_header *section_headers = elf->image.sections;
+  const uint8_t *section_names = section_view(&elf->image, header->e_shstrndx, 1);
+  if (!section_names) {
+     report_error("Section names are out of the file bounds");
+     release_image(&elf->image);
+     return 0x5ec7;
+  }
+  uint32_t section_names_size = section_headers[header->e_shstrndx].sh_size;
+
+  int section_index = -1;
+  int symtab_index = -1;
+  for (int i = 0; i < header->e_shnum; i++) {
+     uint32_t link = section_headers[i].sh_name;
+     if (link < section_names_size &&
+         section_names_size - link >= section_name_length &&
+         !memcmp(section_name, section_names + link, section_name_length)) {
+       section_index = i;
+     }
+     if (section_headers[i].sh_type == 0x2) {
+       symtab_index = i;
+     }
+  }
+
+  // EF_RISCV_RVC marks objects that may contain compressed instructions, those only need 2-byte alignment
+  int compressed = options.rvc || (header->e_flags & 0x1);
+  const uint8_t *text = section_index < 0 ? NULL : section_view(&elf->image, section_index, compressed ? 2 : 4);
+  if (!text) {
+     report_error("There is no readable .text section");
+     release_image(&elf->image);
+     return 0x7e47;
+  }
+  elf->code = (code_view) {text, section_headers[section_index].sh_size, section_headers[section_index].sh_addr,
+                           compressed, section_headers[section_index].sh_addr, section_headers[section_index].sh_size};
+  end_phase(&clock, PHASE_LOAD);
+
+  // Labels are optional: a missing or broken .symtab/.strtab pair just leaves them out
+  start_phase(&clock);
+  if (symtab_index >= 0) {
+     uint32_t strtab_index = section_headers[symtab_index].sh_link;
+     const symtab_entry *symbols = (const symtab_entry *) section_view(&elf->image, symtab_index, 4);
+     const uint8_t *strtab = section_view(&elf->image, strtab_index, 1);
+     if (symbols && strtab) {
+       elf->symbols = symbols;
+       elf->symbols_count = section_headers[symtab_index].sh_size / sizeof(symtab_entry);
+       elf->strtab = strtab;
+       elf->strtab_size = section_headers[strtab_index].sh_size;
+     }
+  }
+
+  if (build_label_index(&elf->labels, elf->symbols, elf->symbols_count, elf->strtab, elf->strtab_size,
+                        memory) != 0) {
+     report_error("Not enough memory for the symbol table");
+     release_image(&elf->image);
+     return 0xa110c;
+  }
+  end_phase(&clock, PHASE_SYMBOLS);
+  return 0;
+}
+
+// --histogram: instruction counts per enum Command, reads and writes of every
+// register and accesses to every CSR, with no line formatted at all. Chunks are
+// decoded on --jobs threads. Each thread counts into a row of its own and adds
+// it to the shared row of the function (or the one row of the whole section)
+// only when the function changes or the chunk ends, so the threads only meet at
+// function boundaries. CSRs are too many to give every row a counter for each;
+// with --by-function a thread notes the row and CSR of every access instead, and
+// those notes are sorted by row once the threads are done.
+typedef struct {
+  uint32_t instructions;
+  uint32_t commands[UNKNOWN + 1];
+  uint32_t reads[32];
+  uint32_t writes[32];
+} histogram_row;
+
+// Every field of a row is a uint32_t counter, which is how rows are added up
+#define HISTOGRAM_COUNTERS (sizeof(histogram_row) / sizeof(uint32_t))
+
+// Registers an instruction of each enum Format writes (bit 0) and reads (rs1 bit 1, rs2 bit 2)
+static const uint8_t format_registers[FORMAT_UNKNOWN + 1] = {
+  [FORMAT_R]     = 7, [FORMAT_I]   = 3, [FORMAT_SHAMT] = 3, [FORMAT_S]       = 6,
+  [FORMAT_B]     = 6, [FORMAT_U]   = 1, [FORMAT_J]     = 1, [FORMAT_CSR]     = 3,
+  [FORMAT_CSR_IMM] = 1,
+};
+
+const char *command_classes[] = {"alu", "load", "store", "branch", "jump", "muldiv", "system", "csr", "unknown"};
+
+#define CLASS_COUNT (sizeof(command_classes) / sizeof(command_classes[0]))
+
+int command_class(enum Command command) {
+  if (command >= LB && command <= LHU) return 1;
+  if (command >= SB && command <= SW) return 2;
+  if (command >= BEQ && command <= BGEU) return 3;
+  if (command == JAL || command == JALR) return 4;
+  if (command >= MUL && command <= REMU) return 5;
+  if (command >= FENCE && command <= EBREAK) return 6;
+  if (command >= CSRRW && command <= CSRRCI) return 7;
+  if (command == UNKNOWN) return 8;
+  return 0;
+}
+
+typedef struct {
+  const code_view   *code;
+  const label_index *labels;
+  const uint32_t    *chunk_starts;
+  int                chunk_count;
+  int                next_chunk;     // taken with an atomic add
+  int                by_function;
+  histogram_row     *rows;           // row 0 is the section before its first label, or the whole section
+} histogram_job;
+
+typedef struct {
+  histogram_job        *job;
+  decoded_instructions  decoded;
+  histogram_row         row;
+  uint32_t             *csrs;        // 4096 counters, added up after the threads are done
+  uint64_t             *csr_uses;    // --by-function: row << 12 | CSR of every access
+  size_t                csr_use_count;
+  size_t                csr_use_capacity;
+  int                   failed;      // out of memory for csr_uses
+} histogram_worker;
+
+int compare_csr_uses(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// The row of the instructions after label `next - 1`, or row 0 before the first
+// label inside the section. The index has one label per address, see build_label_index()
+uint32_t function_row(const label_index *labels, uint32_t next, const code_view *code) {
+  if (next == 0 || labels->entries[next - 1].address < code->section_address) return 0;
+  return next;
+}
+
+void flush_histogram_row(histogram_row *shared, histogram_row *local) {
+  if (local->instructions == 0) return;
+  uint32_t *from = (uint32_t *) local;
+  uint32_t *to = (uint32_t *) shared;
+  for (size_t k = 0; k < HISTOGRAM_COUNTERS; k++) {
+    if (from[k]) __atomic_fetch_add(&to[k], from[k], __ATOMIC_RELAXED);
+  }
+  memset(local, 0, sizeof(histogram_row));
+}
+
+void *histogram_worker_run(void *argument) {
+  histogram_worker *worker = argument;
+  histogram_job *job = worker->job;
+  const code_view *code = job->code;
+  const label_index *labels = job->labels;
+  int chunk;
+  while ((chunk = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED)) < job->chunk_count) {
+    phase_clock clock;
+    start_phase(&clock);
+    uint32_t start = job->chunk_starts[chunk];
+    size_t count = decode_chunk(&worker->decoded, code, start, job->chunk_starts[chunk + 1]);
+    uint32_t address = code->address + start;
+    uint32_t next = job->by_function ? find_label(labels, address + 1) : labels->count;
+    uint32_t row = job->by_function ? function_row(labels, next, code) : 0;
+    histogram_row *local = &worker->row;
+    for (size_t k = 0; k < count; address += worker->decoded.length[k], k++) {
+      if (next < labels->count && labels->entries[next].address <= address) {
+        flush_histogram_row(&job->rows[row], local);
+        while (next < labels->count && labels->entries[next].address <= address) next++;
+        row = function_row(labels, next, code);
+      }
+      enum Command command = worker->decoded.command[k];
+      uint8_t format = worker->decoded.format[k];
+      uint8_t uses = format_registers[format];
+      local->instructions++;
+      local->commands[command]++;
+      local->writes[worker->decoded.rd[k]] += uses & 1;
+      local->reads[worker->decoded.rs1[k]] += (uses >> 1) & 1;
+      local->reads[worker->decoded.rs2[k]] += uses >> 2;
+      if (format != FORMAT_CSR && format != FORMAT_CSR_IMM) continue;
+      uint32_t csr = worker->decoded.imm[k] & 0xfff;
+      worker->csrs[csr]++;
+      if (!job->by_function) continue;
+      if (worker->csr_use_count == worker->csr_use_capacity) {
+        size_t capacity = worker->csr_use_capacity ? worker->csr_use_capacity * 2 : 1024;
+        uint64_t *grown = counted_realloc(worker->csr_uses, capacity * sizeof(uint64_t));
+        if (!grown) {
+          worker->failed = true;
+          continue;
+        }
+        worker->csr_uses = grown;
+        worker->csr_use_capacity = capacity;
+      }
+      worker->csr_uses[worker->csr_use_count++] = (uint64_t) row << 12 | csr;
+    }
+    flush_histogram_row(&job->rows[row], local);
+    count_stat(&stats.instructions, count);
+    end_phase(&clock, PHASE_DECODE);
+  }
+  return NULL;
+}
+
+// printf() into the buffer, for reports that are not worth the put_* helpers
+void put_formatted(output_buffer *out, const char *format, ...) {
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(NULL, 0, format, arguments);
+  va_end(arguments);
+  if (length < 0 || !reserve_output(out, length + 1)) return;
+  va_start(arguments, format);
+  vsnprintf(out->data + out->length, length + 1, format, arguments);
+  va_end(arguments);
+  out->length += length;
+}
+
+// Function names are quoted for CSV when they would split the field, and escaped for JSON
+void put_name(output_buffer *out, const char *name, size_t length, int json) {
+  int quoted = json || memchr(name, ',', length) || memchr(name, '"', length) || memchr(name, '\n', length);
+  if (!reserve_output(out, 6 * length + 2)) return;
+  if (quoted) put_char(out, '"');
+  for (size_t k = 0; k < length; k++) {
+    unsigned char c = name[k];
+    if (c == '"') {
+      put_string(out, json ? "\\\"" : "\"\"", 2);
+    } else if (json && (c == '\\' || c < 0x20)) {
+      out->length += sprintf(out->data + out->length, c == '\\' ? "\\\\" : "\\u%04x", c);
+    } else {
+      put_char(out, c);
+    }
+  }
+  if (quoted) put_char(out, '"');
+}
+
+void put_csv_line(output_buffer *out, const char *name, size_t name_length, uint32_t address, const char *counter,
+                  const char *key, uint64_t count) {
+  size_t counter_length = strlen(counter);
+  size_t key_length = strlen(key);
+  if (name) put_name(out, name, name_length, false);
+  if (!reserve_output(out, counter_length + key_length + 48)) return;
+  if (name) {
+    put_string(out, ",0x", 3);
+    put_address(out, address);
+  } else {
+    put_char(out, ',');
+  }
+  put_char(out, ',');
+  put_string(out, counter, counter_length);
+  put_char(out, ',');
+  put_string(out, key, key_length);
+  put_char(out, ',');
+  put_unsigned(out, count);
+  put_char(out, '\n');
+}
+
+// `"key": count` of a JSON object, after a comma unless it is the first
+void put_json_count(output_buffer *out, int first, const char *key, uint64_t count) {
+  size_t key_length = strlen(key);
+  if (!reserve_output(out, key_length + 32)) return;
+  if (!first) put_string(out, ", ", 2);
+  put_char(out, '"');
+  put_string(out, key, key_length);
+  put_string(out, "\": ", 3);
+  put_unsigned(out, count);
+}
+
+// One row of the report: CSV lines "function,address,counter,key,count" with
+// only the non-zero counts, or a JSON object of the same. The total is the row
+// without a function name. `csrs` has the count of each CSR, of which the
+// `used_count` in `used` are non-zero, in increasing order.
+void put_histogram_row(output_buffer *out, const histogram_row *row, const char *name, size_t name_length,
+                       uint32_t address, const uint32_t *csrs, const uint16_t *used, size_t used_count) {
+  uint64_t classes[CLASS_COUNT] = {0};
+  for (int k = 0; k <= UNKNOWN; k++) classes[command_class(k)] += row->commands[k];
+  struct {
+    const char        *counter;
+    const char *const *keys;
+    const uint32_t    *counts;
+    int                count;
+  } groups[] = {
+    {"command", command_names, row->commands, UNKNOWN + 1},
+    {"read",    registers,     row->reads,    32},
+    {"write",   registers,     row->writes,   32},
+  };
+  int json = options.histogram_json;
+  char key[8];
+
+  if (json) {
+    put_formatted(out, "{");
+    if (name) {
+      put_formatted(out, "\"function\": ");
+      put_name(out, name, name_length, true);
+      put_formatted(out, ", \"address\": \"0x%08x\", ", address);
+    }
+    put_formatted(out, "\"instructions\": %u, \"class\": {", row->instructions);
+  } else {
+    put_csv_line(out, name, name_length, address, "instructions", "", row->instructions);
+  }
+  int first = true;
+  for (size_t k = 0; k < CLASS_COUNT; k++) {
+    if (!classes[k]) continue;
+    if (json) {
+      put_json_count(out, first, command_classes[k], classes[k]);
+    } else {
+      put_csv_line(out, name, name_length, address, "class", command_classes[k], classes[k]);
+    }
+    first = false;
+  }
+  for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+    if (json) put_formatted(out, "}, \"%s\": {", groups[g].counter);
+    first = true;
+    for (int k = 0; k < groups[g].count; k++) {
+      if (!groups[g].counts[k]) continue;
+      if (json) {
+        put_json_count(out, first, groups[g].keys[k], groups[g].counts[k]);
+      } else {
+        put_csv_line(out, name, name_length, address, groups[g].counter, groups[g].keys[k], groups[g].counts[k]);
+      }
+      first = false;
+    }
+  }
+  if (json) put_formatted(out, "}, \"csr\": {");
+  for (size_t k = 0; k < used_count; k++) {
+    snprintf(key, sizeof(key), "0x%03x", used[k]);
+    if (json) {
+      put_json_count(out, k == 0, key, csrs[used[k]]);
+    } else {
+      put_csv_line(out, name, name_length, address, "csr", key, csrs[used[k]]);
+    }
+  }
+  if (json) put_formatted(out, "}}");
+}
+
+// --histogram: counts the instructions of `code` and writes the report to `target`
+int histogram_section(const code_view *code, const label_index *labels, int jobs, output_target *target,
+                      arena *memory) {
+  uint32_t *chunk_starts;
+  uint32_t instruction_count;
+  int chunk_count = plan_chunks(code, &chunk_starts, &instruction_count, memory);
+  uint32_t row_count = options.by_function ? labels->count + 1 : 1;
+  if (jobs > chunk_count) jobs = chunk_count;
+  if (jobs < 1) jobs = 1;
+  histogram_row *rows = chunk_count < 0 ? NULL : arena_alloc(memory, row_count * sizeof(histogram_row));
+  histogram_worker *workers = arena_alloc(memory, jobs * sizeof(histogram_worker));
+  pthread_t *threads = arena_alloc(memory, jobs * sizeof(pthread_t));
+  histogram_job job = {code, labels, chunk_starts, chunk_count, 0, options.by_function, rows};
+  int allocated = 0;
+  while (rows && workers && threads && allocated < jobs) {
+    histogram_worker *worker = &workers[allocated];
+    memset(worker, 0, sizeof(histogram_worker));
+    worker->job = &job;
+    worker->csrs = arena_alloc(memory, 4096 * sizeof(uint32_t));
+    if (!worker->csrs || arena_decoded(&worker->decoded, CHUNK_SIZE, memory) != 0) break;
+    memset(worker->csrs, 0, 4096 * sizeof(uint32_t));
+    allocated++;
+  }
+  if (allocated < jobs) {
+    report_error("Not enough memory for the histogram");
+    return 0xa110c;
+  }
+  memset(rows, 0, row_count * sizeof(histogram_row));
+
+  // This thread is the first worker
+  int started = 1;
+  while (started < jobs && pthread_create(&threads[started], NULL, histogram_worker_run, &workers[started]) == 0) {
+    started++;
+  }
+  histogram_worker_run(&workers[0]);
+  for (int i = 1; i < started; i++) pthread_join(threads[i], NULL);
+
+  phase_clock clock;
+  start_phase(&clock);
+  uint32_t *csrs = workers[0].csrs;
+  for (int i = 1; i < started; i++) {
+    for (int k = 0; k < 4096; k++) csrs[k] += workers[i].csrs[k];
+  }
+  uint16_t *used = arena_alloc(memory, 4096 * sizeof(uint16_t));
+  size_t used_count = 0;
+  for (int k = 0; used && k < 4096; k++) {
+    if (csrs[k]) used[used_count++] = k;
+  }
+  // The CSR accesses of all threads in the order of their rows
+  size_t use_count = 0;
+  int failed = !used;
+  for (int i = 0; i < jobs; i++) {
+    use_count += workers[i].csr_use_count;
+    failed |= workers[i].failed;
+  }
+  uint64_t *uses = failed ? NULL : arena_alloc(memory, (use_count + 1) * sizeof(uint64_t));
+  uint32_t *row_csrs = uses ? arena_alloc(memory, 4096 * sizeof(uint32_t)) : NULL;
+  uint16_t *row_used = row_csrs ? arena_alloc(memory, 4096 * sizeof(uint16_t)) : NULL;
+  if (row_used) {
+    use_count = 0;
+    for (int i = 0; i < jobs; i++) {
+      memcpy(uses + use_count, workers[i].csr_uses, workers[i].csr_use_count * sizeof(uint64_t));
+      use_count += workers[i].csr_use_count;
+    }
+    qsort(uses, use_count, sizeof(uint64_t), compare_csr_uses);
+    memset(row_csrs, 0, 4096 * sizeof(uint32_t));
+  }
+  for (int i = 0; i < jobs; i++) counted_free(workers[i].csr_uses);
+  if (!row_used) {
+    report_error("Not enough memory for the histogram");
+    return 0xa110c;
+  }
+  histogram_row total = rows[0];
+  for (uint32_t r = 1; r < row_count; r++) {
+    uint32_t *from = (uint32_t *) &rows[r];
+    uint32_t *to = (uint32_t *) &total;
+    for (size_t k = 0; k < HISTOGRAM_COUNTERS; k++) to[k] += from[k];
+  }
+
+  output_buffer out = {.memory = memory};
+  int json = options.histogram_json;
+  put_formatted(&out, json ? "{\"total\": " : "function,address,counter,key,count\n");
+  put_histogram_row(&out, &total, NULL, 0, 0, csrs, used, used_count);
+  if (options.by_function) {
+    if (json) put_formatted(&out, ", \"functions\": [");
+    int first = true;
+    size_t next_use = 0;
+    for (uint32_t r = 0; r < row_count; r++) {
+      // The uses are sorted by CSR within a row, so row_used comes out in order
+      size_t row_used_count = 0;
+      for (; next_use < use_count && uses[next_use] >> 12 == r; next_use++) {
+        uint32_t csr = uses[next_use] & 0xfff;
+        if (row_csrs[csr]++ == 0) row_used[row_used_count++] = csr;
+      }
+      if (rows[r].instructions == 0) continue;
+      // Row 0 holds what comes before the first label, labels are "<name>"
+      const char *name = r == 0 ? "<.text>" : labels->pool + labels->entries[r - 1].name;
+      uint32_t address = r == 0 ? code->address : labels->entries[r - 1].address;
+      if (json && !first) put_formatted(&out, ", ");
+      put_histogram_row(&out, &rows[r], name + 1, strlen(name) - 2, address, row_csrs, row_used, row_used_count);
+      for (size_t k = 0; k < row_used_count; k++) row_csrs[row_used[k]] = 0;
+      first = false;
+    }
+    if (json) put_formatted(&out, "]");
+  }
+  if (json) put_formatted(&out, "}\n");
+  end_phase(&clock, PHASE_FORMAT);
+  return write_output(target, &out);
+}
+
+// --trace: every PC of a trace annotated with its line and function. The
+// section is decoded and formatted once into `text`, without labels, and
+// `lines` gives the line of each 4-byte (or 2-byte, for RVC) slot as
+// text[lines[slot], lines[slot + 1]). Slots inside an instruction have an
+// empty line. `functions` has the label of each slot's function (1 + the
+// index, 0 for none), so a PC takes one table lookup and two copies.
+typedef struct {
+  const code_view   *code;
+  const label_index *labels;
+  output_buffer      text;
+  size_t            *lines;
+  uint32_t          *functions;
+  uint32_t          *name_lengths;   // of every label, without the closing '>'
+  uint32_t           slots;
+  int                shift;          // log2 of the slot size
+} trace_table;
+
+int build_trace_table(trace_table *table, const code_view *code, const label_index *labels, arena *memory) {
+  uint32_t *chunk_starts;
+  uint32_t instruction_count;
+  int chunk_count = plan_chunks(code, &chunk_starts, &instruction_count, memory);
+  table->code = code;
+  table->labels = labels;
+  table->shift = code->compressed ? 1 : 2;
+  table->slots = code->size >> table->shift;
+  table->lines = arena_alloc(memory, (table->slots + 1) * sizeof(size_t));
+  table->functions = arena_alloc(memory, (table->slots + 1) * sizeof(uint32_t));
+  table->name_lengths = arena_alloc(memory, (labels->count + 1) * sizeof(uint32_t));
+  decoded_instructions decoded;
+  if (chunk_count < 0 || !table->lines || !table->functions || !table->name_lengths ||
+      arena_decoded(&decoded, CHUNK_SIZE, memory) != 0) {
+    report_error("Not enough memory for the trace table");
+    return 0xa110c;
+  }
+  for (uint32_t k = 0; k < labels->count; k++) table->name_lengths[k] = strlen(labels->pool + labels->entries[k].name) - 1;
+
+  // Reserved for an average line up front, as copies of a growing buffer of this size dominate the build. The
+  // text is the last allocation, so it still grows in place past that
+  output_buffer *out = &table->text;
+  *out = (output_buffer) {.memory = memory};
+  reserve_output(out, (size_t) instruction_count * 24);
+  uint32_t next_slot = 0;
+  // Labels below the section are not functions of it, like the rows of --histogram --by-function
+  uint32_t first_label = find_label(labels, code->address);
+  uint32_t next_label = find_label(labels, code->address + 1);
+  for (int chunk = 0; chunk < chunk_count && !out->failed; chunk++) {
+    phase_clock clock;
+    start_phase(&clock);
+    size_t count = decode_chunk(&decoded, code, chunk_starts[chunk], chunk_starts[chunk + 1]);
+    end_phase(&clock, PHASE_DECODE);
+    count_stat(&stats.instructions, count);
+
+    start_phase(&clock);
+    uint32_t offset = chunk_starts[chunk];
+    for (size_t k = 0; k < count; offset += decoded.length[k], k++) {
+      uint32_t slot = offset >> table->shift;
+      for (; next_slot <= slot; next_slot++) table->lines[next_slot] = out->length;
+      // As for --annotate, the function is the last label at or before the instruction
+      while (next_label < labels->count && labels->entries[next_label].address <= code->address + offset) next_label++;
+      table->functions[slot] = next_label > first_label ? next_label : 0;
+      const command_descriptor *command = &command_descriptors[decoded.command[k]];
+      command->show(out, command, decoded.rd[k], decoded.rs1[k], decoded.rs2[k], decoded.imm[k],
+                    code->address + offset, "");
+      if (out->length > 0 && out->data[out->length - 1] == '\n') out->length--;
+    }
+    end_phase(&clock, PHASE_FORMAT);
+  }
+  for (; next_slot <= table->slots; next_slot++) table->lines[next_slot] = out->length;
+  if (out->failed) {
+    report_error("Not enough memory for the trace table");
+    return 0xa110c;
+  }
+  return 0;
+}
+
+// Appends the line of `pc` and " <func+0x1c>", or "%08x: ?" when no instruction starts there
+void put_trace_line(output_buffer *out, const trace_table *table, uint32_t pc) {
+  uint32_t offset = pc - table->code->address;
+  uint32_t slot = offset >> table->shift;
+  if (slot >= table->slots || (offset & ((1 << table->shift) - 1)) || table->lines[slot] == table->lines[slot + 1]) {
+    if (!reserve_output(out, 16)) return;
+    put_address(out, pc);
+    put_string(out, ": ?\n", 4);
+    return;
+  }
+  size_t length = table->lines[slot + 1] - table->lines[slot];
+  uint32_t function = table->functions[slot];
+  uint32_t name_length = function ? table->name_lengths[function - 1] : 0;
+  if (!reserve_output(out, length + name_length + 16)) return;
+  put_string(out, table->text.data + table->lines[slot], length);
+  if (function) {
+    const label_entry *label = &table->labels->entries[function - 1];
+    put_char(out, ' ');
+    put_string(out, table->labels->pool + label->name, name_length);
+    uint32_t distance = pc - label->address;
+    if (distance != 0) {
+      put_string(out, "+0x", 3);
+      int digits = 1;
+      while (digits < 8 && distance >> (4 * digits)) digits++;
+      for (int i = digits - 1; i >= 0; i--) put_char(out, hex_digits[(distance >> (4 * i)) & 0xf]);
+    }
+    put_char(out, '>');
+  }
+  put_char(out, '\n');
+}
+
+// One more than the value of every hex digit, 0 for anything else
+static const uint8_t hex_values[256] = {
+  ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,  ['5'] = 6,  ['6'] = 7,  ['7'] = 8,
+  ['8'] = 9,  ['9'] = 10, ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+  ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+// Bytes of the trace read at a time; a line longer than that is an error
+#define TRACE_BLOCK_SIZE (1 << 20)
+
+// Reads a trace of one hex PC per line (with or without 0x, anything after the
+// PC ignored, blank lines skipped) and writes the annotated lines to `target`
+// as it goes, so the trace may be a pipe from the simulator.
+int stream_trace(FILE *trace, const trace_table *table, output_target *target, arena *memory) {
+  char *block = arena_alloc(memory, TRACE_BLOCK_SIZE);
+  output_buffer out = {.memory = memory};
+  if (!block) {
+    report_error("Not enough memory for the trace");
+    return 0xa110c;
+  }
+  uint64_t line_number = 0;
+  size_t pending = 0;
+  int error = 0;
+  int finished = false;
+  while (!finished && error == 0) {
+    size_t size = pending + fread(block + pending, 1, TRACE_BLOCK_SIZE - pending, trace);
+    if (ferror(trace)) {
+      report_error("Trace file could not be read");
+      return 0x4ead;
+    }
+    finished = size < TRACE_BLOCK_SIZE;
+    // The last line of the file may lack its newline
+    if (finished && size > 0 && block[size - 1] != '\n') block[size++] = '\n';
+    const char *cursor = block;
+    const char *end = block + size;
+    const char *line_end;
+    phase_clock clock;
+    start_phase(&clock);
+    while (error == 0 && (line_end = memchr(cursor, '\n', end - cursor))) {
+      line_number++;
+      while (cursor < line_end && (*cursor == ' ' || *cursor == '\t')) cursor++;
+      if (cursor + 1 < line_end && cursor[0] == '0' && (cursor[1] == 'x' || cursor[1] == 'X')) cursor += 2;
+      uint64_t pc = 0;
+      int digits = 0;
+      for (; cursor < line_end && hex_values[(uint8_t) *cursor] && digits <= 16; cursor++, digits++) {
+        pc = pc << 4 | (hex_values[(uint8_t) *cursor] - 1);
+      }
+      // Simulators that print 64-bit PCs show RV32 addresses zero- or sign-extended
+      if (digits > 0 && digits <= 16 && (pc >> 32 == 0 || pc >> 32 == 0xffffffff)) {
+        put_trace_line(&out, table, (uint32_t) pc);
+      } else if (digits > 0 || (cursor < line_end && *cursor != '\r')) {
+        report_error("Line %llu of the trace is not an address", (unsigned long long) line_number);
+        error = 0x7ace;
+      }
+      cursor = line_end + 1;
+    }
+    end_phase(&clock, PHASE_FORMAT);
+    if (error == 0 && out.length >= TRACE_BLOCK_SIZE) {
+      error = write_output(target, &out);
+      out.length = 0;
+    }
+    pending = end - cursor;
+    if (error == 0 && pending == TRACE_BLOCK_SIZE) {
+      report_error("Line %llu of the trace is too long", (unsigned long long) line_number + 1);
+      error = 0x7ace;
+    }
+    memmove(block, cursor, pending);
+  }
+  if (error == 0) error = write_output(target, &out);
+  return error;
+}
+
+// --trace: annotates every PC of `trace` with the line and function of the ELF file in `file`
+int disassemble_trace(FILE *file, FILE *trace, int fd, arena *memory) {
+  elf_input elf;
+  int error = open_elf(&elf, file, memory);
+  if (error != 0) return error;
+  count_stat(&stats.text_bytes, elf.code.size);
+  trace_table table;
+  error = build_trace_table(&table, &elf.code, &elf.labels, memory);
+  output_target target = {fd, -1};
+  if (error == 0) error = stream_trace(trace, &table, &target, memory);
+  close_elf(&elf);
+  return error;
+}
+
+// Disassembles the ELF file in `file` to `fd` and returns 0 or the error code
+int disassemble_file(FILE *file, int fd, int jobs, int *cache_result, arena *memory) {
+  elf_input elf;
+  int error = open_elf(&elf, file, memory);
+  if (error != 0) return error;
+
+  phase_clock clock;
+  start_phase(&clock);
+  if (options.query.symbol || options.query.ranged || options.query.addressed) {
+     error = select_range(&options.query, &elf.code, &elf.labels, elf.symbols, elf.symbols_count, elf.strtab,
+                          elf.strtab_size);
+  }
+  if (error == 0 && options.annotate && !options.binary) error = add_local_labels(&elf.labels, &elf.code, memory);
+  end_phase(&clock, PHASE_SYMBOLS);
+  count_stat(&stats.text_bytes, elf.code.size);
+  if (error == 0 && options.histogram) {
+     output_target target = {fd, -1};
+     error = histogram_section(&elf.code, &elf.labels, jobs, &target, memory);
+  } else if (error == 0) {
+     error = disassemble_cached(&elf.code, &elf.labels, jobs, fd, cache_result, memory);
+  }
+  close_elf(&elf);
+  return error;
+}
+
+
+// --diff: the functions of two builds are paired by name and compared on their
+// instructions with the immediates a linker fills in left out, so a function
+// that only moved, or only calls and loads things that moved, is unchanged.
+// Functions with identical bytes are passed over with a memcmp(), the rest are
+// decoded and hashed, and only those whose hashes differ are formatted, so the
+// time goes with the size of the change rather than of the image.
+typedef struct {
+  const char *name;       // "<name>" in the label pool
+  uint32_t    start;      // bytes [start, end) of .text
+  uint32_t    end;
+  uint32_t    partner;    // the function of the same name in the other build, UINT32_MAX for none
+} diff_function;
+
+typedef struct {
+  elf_input      elf;
+  const char    *path;
+  diff_function *functions;     // in address order
+  uint32_t       count;
+} diff_side;
+
+// One function decoded for comparing: a key per instruction and, when it is
+// to be shown, its lines
+typedef struct {
+  uint64_t      *keys;
+  size_t         count;
+  size_t         capacity;
+  output_buffer  text;
+  size_t        *lines;         // start of each line in text, count + 1 of them
+} function_body;
+
+enum { EDIT_KEEP, EDIT_REMOVE, EDIT_ADD };
+
+// Lines of context around each change
+#define DIFF_CONTEXT 3
+
+// Edits beyond which edit_script() stops looking for the shortest script
+#define DIFF_EDIT_LIMIT 2048
+
+// Splits .text at the labels. The bytes before the first one, all of them in a
+// stripped file, make up a function named "<.text>".
+int list_functions(diff_side *side, arena *memory) {
+  const code_view *code = &side->elf.code;
+  const label_index *labels = &side->elf.labels;
+  side->count = 0;
+  side->functions = arena_alloc(memory, (labels->count + 1) * sizeof(diff_function));
+  if (!side->functions) return 0xa110c;
+  for (uint32_t k = 0; k < labels->count; k++) {
+    uint32_t start = labels->entries[k].address - code->address;
+    if (start >= code->size || start % (code->compressed ? 2 : 4) != 0) continue;
+    if (side->count == 0 && start > 0) side->functions[side->count++] = (diff_function) {"<.text>", 0, start, UINT32_MAX};
+    if (side->count > 0) side->functions[side->count - 1].end = start;
+    side->functions[side->count++] = (diff_function) {labels->pool + labels->entries[k].name, start, code->size,
+                                                      UINT32_MAX};
+  }
+  if (side->count == 0 && code->size > 0) side->functions[side->count++] = (diff_function) {"<.text>", 0, code->size,
+                                                                                           UINT32_MAX};
+  return 0;
+}
+
+int compare_function_names(const void *a, const void *b) {
+  const diff_function *x = *(const diff_function **) a;
+  const diff_function *y = *(const diff_function **) b;
+  int order = strcmp(x->name, y->name);
+  if (order != 0) return order;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Sets `partner` of the functions with the same name on both sides. Names that
+// occur more than once (static functions) are paired in address order.
+int pair_functions(diff_side *old, diff_side *new, arena *memory) {
+  diff_function **old_names = arena_alloc(memory, (old->count + 1) * sizeof(diff_function *));
+  diff_function **new_names = arena_alloc(memory, (new->count + 1) * sizeof(diff_function *));
+  if (!old_names || !new_names) return 0xa110c;
+  for (uint32_t k = 0; k < old->count; k++) old_names[k] = &old->functions[k];
+  for (uint32_t k = 0; k < new->count; k++) new_names[k] = &new->functions[k];
+  qsort(old_names, old->count, sizeof(diff_function *), compare_function_names);
+  qsort(new_names, new->count, sizeof(diff_function *), compare_function_names);
+  uint32_t i = 0;
+  uint32_t j = 0;
+  while (i < old->count && j < new->count) {
+    int order = strcmp(old_names[i]->name, new_names[j]->name);
+    if (order == 0) {
+      old_names[i]->partner = new_names[j] - new->functions;
+      new_names[j]->partner = old_names[i] - old->functions;
+    }
+    if (order <= 0) i++;
+    if (order >= 0) j++;
+  }
+  return 0;
+}
+
+// Entry k of `decoded`, at byte `offset` of a function of `size` bytes, with
+// only the fields its format uses. Immediates a relocation would patch are left
+// out: those of LUI and AUIPC, of the ADDI, JALR, loads and stores that take
+// their base from one (`upper` has a bit per register holding such a result),
+// and of jumps and branches that leave the function.
+static inline uint64_t instruction_key(const decoded_instructions *decoded, size_t k, const uint8_t *bytes,
+                                       uint32_t offset, uint32_t size, uint32_t *upper) {
+  enum Command command = decoded->command[k];
+  enum Format format = decoded->format[k];
+  uint32_t rd  = decoded->rd[k];
+  uint32_t rs1 = decoded->rs1[k];
+  uint32_t rs2 = decoded->rs2[k];
+  uint32_t imm = decoded->imm[k];
+  if (command == LUI || command == AUIPC) {
+    imm = 0;
+  } else if (format == FORMAT_J || format == FORMAT_B) {
+    if (offset + imm >= size) imm = 0;
+  } else if ((command == JALR || (command >= LB && command <= ADDI)) && (*upper >> rs1 & 1)) {
+    imm = 0;
+  }
+
+  switch (format) {
+    case FORMAT_R:
+      imm = 0;
+      break;
+    case FORMAT_I:
+    case FORMAT_SHAMT:
+    case FORMAT_CSR:
+    case FORMAT_CSR_IMM:
+      rs2 = 0;
+      break;
+    case FORMAT_S:
+    case FORMAT_B:
+      rd = 0;
+      break;
+    case FORMAT_U:
+    case FORMAT_J:
+      rs1 = rs2 = 0;
+      break;
+    case FORMAT_FENCE:
+      rd = rs1 = rs2 = 0;
+      break;
+    case FORMAT_SYSTEM:
+      rd = rs1 = rs2 = imm = 0;
+      break;
+    default:
+      // Nothing decoded, so the raw bits are all there is to compare
+      rd = rs1 = rs2 = imm = 0;
+      memcpy(&imm, bytes + offset, decoded->length[k]);
+  }
+
+  int writes_rd = format != FORMAT_S && format != FORMAT_B && format != FORMAT_FENCE && format != FORMAT_SYSTEM &&
+                  format != FORMAT_UNKNOWN;
+  if (command == LUI || command == AUIPC) {
+    *upper |= 1u << rd;
+  } else if (writes_rd) {
+    *upper &= ~(1u << rd);
+  }
+  *upper &= ~1u;
+  return (uint64_t) imm << 32 | (uint64_t) decoded->length[k] << 24 | rs2 << 18 | rs1 << 13 | rd << 8 | command;
+}
+
+// Decodes `function` of `code` into the keys of `body` and, with `with_text`,
+// its lines. Addresses in the lines are relative to the function, so that they
+// stay the same when the function moves.
+int read_function(function_body *body, const code_view *code, const diff_function *function,
+                  decoded_instructions *decoded, int with_text) {
+  code_view view = *code;
+  view.bytes += function->start;
+  view.size = function->end - function->start;
+  view.address = 0;
+  label_index no_labels = {NULL, 0, NULL};
+  body->count = 0;
+  body->text.length = 0;
+  body->text.failed = false;
+  uint32_t upper = 0;
+  uint32_t offset = 0;
+  while (offset < view.size) {
+    size_t count;
+    uint32_t used;
+    if (with_text) {
+      used = disassemble_chunk(&body->text, decoded, &view, offset, view.size, &no_labels);
+      count = 0;
+      for (uint32_t bytes = 0; bytes < used; bytes += decoded->length[count], count++) {}
+    } else {
+      count = decode_chunk(decoded, &view, offset, view.size);
+      used = 0;
+      for (size_t k = 0; k < count; k++) used += decoded->length[k];
+    }
+    if (count == 0) break;
+    if (body->count + count > body->capacity) {
+      size_t capacity = body->capacity ? body->capacity : 1024;
+      while (capacity < body->count + count) capacity *= 2;
+      uint64_t *keys = counted_realloc(body->keys, capacity * sizeof(uint64_t));
+      if (!keys) return 0xa110c;
+      body->keys = keys;
+      body->capacity = capacity;
+    }
+    uint32_t position = offset;
+    for (size_t k = 0; k < count; position += decoded->length[k], k++) {
+      body->keys[body->count++] = instruction_key(decoded, k, view.bytes, position, view.size, &upper);
+    }
+    offset += used;
+  }
+  if (!with_text) return 0;
+  if (body->text.failed) return 0xa110c;
+
+  counted_free(body->lines);
+  body->lines = counted_malloc((body->count + 1) * sizeof(size_t));
+  if (!body->lines) return 0xa110c;
+  size_t line = 0;
+  body->lines[0] = 0;
+  for (size_t k = 0; k < body->text.length && line < body->count; k++) {
+    if (body->text.data[k] == '\n') body->lines[++line] = k + 1;
+  }
+  while (line < body->count) body->lines[++line] = body->text.length;
+  return 0;
+}
+
+void free_function_body(function_body *body) {
+  counted_free(body->keys);
+  counted_free(body->text.data);
+  counted_free(body->lines);
+}
+
+// Shortest edit script from a[0..n) to b[0..m) by Myers' O(ND) algorithm, at
+// most n + m edits. Past DIFF_EDIT_LIMIT edits it settles for removing and
+// adding the whole middle: still a correct diff, only a longer one.
+int edit_script(const uint64_t *a, size_t n, const uint64_t *b, size_t m, uint8_t *edits, size_t *edit_count) {
+  size_t count = 0;
+  size_t prefix = 0;
+  while (prefix < n && prefix < m && a[prefix] == b[prefix]) prefix++;
+  size_t suffix = 0;
+  while (suffix < n - prefix && suffix < m - prefix && a[n - 1 - suffix] == b[m - 1 - suffix]) suffix++;
+  for (size_t k = 0; k < prefix; k++) edits[count++] = EDIT_KEEP;
+  a += prefix;
+  b += prefix;
+  int32_t x_size = n - prefix - suffix;
+  int32_t y_size = m - prefix - suffix;
+
+  int32_t limit = x_size + y_size < DIFF_EDIT_LIMIT ? x_size + y_size : DIFF_EDIT_LIMIT;
+  // trace holds v as it was before round d at [d * d, d * d + 2d], for k from -d to d
+  int32_t *v = counted_calloc(2 * limit + 3, sizeof(int32_t));
+  int32_t *trace = counted_malloc((size_t) (limit + 1) * (limit + 1) * sizeof(int32_t));
+  if (!v || !trace) {
+    counted_free(v);
+    counted_free(trace);
+    return 0xa110c;
+  }
+  int32_t *diagonal = v + limit + 1;
+  int32_t found = -1;
+  for (int32_t d = 0; d <= limit && found < 0; d++) {
+    memcpy(trace + d * d, diagonal - d, (2 * d + 1) * sizeof(int32_t));
+    for (int32_t k = -d; k <= d; k += 2) {
+      int32_t x = k == -d || (k != d && diagonal[k - 1] < diagonal[k + 1]) ? diagonal[k + 1] : diagonal[k - 1] + 1;
+      int32_t y = x - k;
+      while (x < x_size && y < y_size && a[x] == b[y]) {
+        x++;
+        y++;
+      }
+      diagonal[k] = x;
+      if (x >= x_size && y >= y_size) {
+        found = d;
+        break;
+      }
+    }
+  }
+
+  size_t middle = count;
+  if (found < 0) {
+    for (int32_t k = 0; k < y_size; k++) edits[count++] = EDIT_ADD;
+    for (int32_t k = 0; k < x_size; k++) edits[count++] = EDIT_REMOVE;
+  } else {
+    // Walks back from the end, so the edits come out last first
+    int32_t x = x_size;
+    int32_t y = y_size;
+    for (int32_t d = found; d >= 0; d--) {
+      const int32_t *previous = trace + d * d + d;
+      int32_t k = x - y;
+      int32_t previous_x = 0;
+      int32_t previous_y = 0;
+      if (d > 0) {
+        int32_t previous_k = k == -d || (k != d && previous[k - 1] < previous[k + 1]) ? k + 1 : k - 1;
+        previous_x = previous[previous_k];
+        previous_y = previous_x - previous_k;
+      }
+      while (x > previous_x && y > previous_y) {
+        edits[count++] = EDIT_KEEP;
+        x--;
+        y--;
+      }
+      if (d > 0) edits[count++] = x == previous_x ? EDIT_ADD : EDIT_REMOVE;
+      x = previous_x;
+      y = previous_y;
+    }
+  }
+  for (size_t low = middle, high = count; low + 1 < high; low++, high--) {
+    uint8_t edit = edits[low];
+    edits[low] = edits[high - 1];
+    edits[high - 1] = edit;
+  }
+  counted_free(v);
+  counted_free(trace);
+  for (size_t k = 0; k < suffix; k++) edits[count++] = EDIT_KEEP;
+  *edit_count = count;
+  return 0;
+}
+
+void put_body_line(output_buffer *out, char mark, const function_body *body, size_t line) {
+  size_t length = body->lines[line + 1] - body->lines[line];
+  if (!reserve_output(out, length + 2)) return;
+  put_char(out, mark);
+  put_string(out, body->text.data + body->lines[line], length);
+}
+
+// "@@ -START,COUNT +START,COUNT @@", a START is 1-based except that of an empty side
+void put_hunk_header(output_buffer *out, size_t old_start, size_t old_count, size_t new_start, size_t new_count) {
+  if (!reserve_output(out, 96)) return;
+  put_string(out, "@@ -", 4);
+  put_unsigned(out, old_count ? old_start + 1 : old_start);
+  put_char(out, ',');
+  put_unsigned(out, old_count);
+  put_string(out, " +", 2);
+  put_unsigned(out, new_count ? new_start + 1 : new_start);
+  put_char(out, ',');
+  put_unsigned(out, new_count);
+  put_string(out, " @@\n", 4);
+}
+
+// Writes the hunks of `edits`, each change with up to DIFF_CONTEXT unchanged
+// lines around it; changes closer than twice that share a hunk
+void put_hunks(output_buffer *out, const uint8_t *edits, size_t count, const function_body *old,
+               const function_body *new) {
+  size_t i = 0;
+  size_t old_line = 0;
+  size_t new_line = 0;
+  size_t printed = 0;
+  while (i < count) {
+    if (edits[i] == EDIT_KEEP) {
+      i++;
+      old_line++;
+      new_line++;
+      continue;
+    }
+    size_t before = i - printed < DIFF_CONTEXT ? i - printed : DIFF_CONTEXT;
+    size_t start = i - before;
+    size_t end = i;
+    while (true) {
+      while (end < count && edits[end] != EDIT_KEEP) end++;
+      size_t kept = 0;
+      while (end + kept < count && edits[end + kept] == EDIT_KEEP) kept++;
+      if (end + kept < count && kept <= 2 * DIFF_CONTEXT) {
+        end += kept;
+        continue;
+      }
+      end += kept < DIFF_CONTEXT ? kept : DIFF_CONTEXT;
+      break;
+    }
+
+    size_t old_count = 0;
+    size_t new_count = 0;
+    for (size_t k = start; k < end; k++) {
+      old_count += edits[k] != EDIT_ADD;
+      new_count += edits[k] != EDIT_REMOVE;
+    }
+    size_t old_at = old_line - before;
+    size_t new_at = new_line - before;
+    put_hunk_header(out, old_at, old_count, new_at, new_count);
+    for (size_t k = start; k < end; k++) {
+      if (edits[k] == EDIT_KEEP) {
+        put_body_line(out, ' ', new, new_at++);
+        old_at++;
+      } else if (edits[k] == EDIT_REMOVE) {
+        put_body_line(out, '-', old, old_at++);
+      } else {
+        put_body_line(out, '+', new, new_at++);
+      }
+    }
+    old_line = old_at;
+    new_line = new_at;
+    i = printed = end;
+  }
+}
+
+// "--- PATH:NAME" or "--- /dev/null" for a function that is not there
+void put_file_header(output_buffer *out, const char *mark, const diff_side *side, const diff_function *function) {
+  const char *name = function ? function->name : NULL;
+  size_t path_length = strlen(side->path);
+  size_t name_length = name ? strlen(name) : 0;
+  if (!reserve_output(out, path_length + name_length + 16)) return;
+  put_string(out, mark, 4);
+  if (name) {
+    put_string(out, side->path, path_length);
+    put_char(out, ':');
+    put_string(out, name + 1, name_length - 2);
+  } else {
+    put_string(out, "/dev/null", 9);
+  }
+  put_char(out, '\n');
+}
+
+typedef struct {
+  diff_side            old;
+  diff_side            new;
+  decoded_instructions decoded;
+  function_body        old_body;
+  function_body        new_body;
+  uint8_t             *edits;
+  size_t               edits_capacity;
+  output_buffer        out;
+} diff_state;
+
+// Whether the pair of functions differs once relocations are left out
+int functions_differ(diff_state *state, const diff_function *old, const diff_function *new, int *error) {
+  uint32_t size = old->end - old->start;
+  if (size == new->end - new->start &&
+      !memcmp(state->old.elf.code.bytes + old->start, state->new.elf.code.bytes + new->start, size)) {
+    return false;
+  }
+  *error = read_function(&state->old_body, &state->old.elf.code, old, &state->decoded, false);
+  if (*error == 0) *error = read_function(&state->new_body, &state->new.elf.code, new, &state->decoded, false);
+  if (*error != 0) return false;
+  const function_body *a = &state->old_body;
+  const function_body *b = &state->new_body;
+  return a->count != b->count ||
+         hash_bytes(a->keys, a->count * sizeof(uint64_t), 0) != hash_bytes(b->keys, b->count * sizeof(uint64_t), 0);
+}
+
+// Writes the diff of a function, `old` or `new` is NULL for one that was added or removed
+int write_function_diff(diff_state *state, const diff_function *old, const diff_function *new, output_target *target) {
+  int error = 0;
+  state->old_body.count = 0;
+  state->new_body.count = 0;
+  if (old) error = read_function(&state->old_body, &state->old.elf.code, old, &state->decoded, true);
+  if (new && error == 0) error = read_function(&state->new_body, &state->new.elf.code, new, &state->decoded, true);
+  size_t capacity = state->old_body.count + state->new_body.count;
+  if (error == 0 && capacity > state->edits_capacity) {
+    uint8_t *edits = counted_realloc(state->edits, capacity);
+    if (!edits) {
+      error = 0xa110c;
+    } else {
+      state->edits = edits;
+      state->edits_capacity = capacity;
+    }
+  }
+  size_t edit_count;
+  if (error == 0) error = edit_script(state->old_body.keys, state->old_body.count, state->new_body.keys,
+                                      state->new_body.count, state->edits, &edit_count);
+  if (error != 0) {
+    report_error("Not enough memory for the diff");
+    return error;
+  }
+  state->out.length = 0;
+  put_file_header(&state->out, "--- ", &state->old, old);
+  put_file_header(&state->out, "+++ ", &state->new, new);
+  put_hunks(&state->out, state->edits, edit_count, &state->old_body, &state->new_body);
+  return write_output(target, &state->out);
+}
+
+int open_diff_side(diff_side *side, FILE *file, const char *path, arena *memory) {
+  side->path = path;
+  side->functions = NULL;
+  int error = open_elf(&side->elf, file, memory);
+  if (error != 0) return error;
+  if (list_functions(side, memory) != 0) {
+    report_error("Not enough memory for the functions");
+    return 0xa110c;
+  }
+  return 0;
+}
+
+// --diff: writes a unified diff of the functions that changed between the ELF
+// files `old_file` and `new_file` to `fd`, in the address order of the new one
+// with the removed functions last. `changed` is set when there is any difference.
+// The bodies and the edit script are reused from one function to the next and
+// stay on the heap; everything per file comes from `memory`.
+int disassemble_diff(FILE *old_file, const char *old_path, FILE *new_file, const char *new_path, int fd,
+                     int *changed, arena *memory) {
+  diff_state state;
+  memset(&state, 0, sizeof(state));
+  *changed = false;
+  int error = open_diff_side(&state.old, old_file, old_path, memory);
+  if (error == 0) error = open_diff_side(&state.new, new_file, new_path, memory);
+  if (error == 0 && (pair_functions(&state.old, &state.new, memory) != 0 ||
+                     arena_decoded(&state.decoded, CHUNK_SIZE, memory) != 0)) {
+    report_error("Not enough memory for the functions");
+    error = 0xa110c;
+  }
+
+  output_target target = {fd, -1};
+  uint32_t compared = 0;
+  uint32_t modified = 0;
+  uint32_t added = 0;
+  uint32_t removed = 0;
+  for (uint32_t k = 0; k < state.new.count && error == 0; k++) {
+    const diff_function *new = &state.new.functions[k];
+    const diff_function *old = new->partner == UINT32_MAX ? NULL : &state.old.functions[new->partner];
+    if (old) {
+      compared++;
+      if (!functions_differ(&state, old, new, &error)) continue;
+      modified++;
+    } else {
+      added++;
+    }
+    error = write_function_diff(&state, old, new, &target);
+  }
+  for (uint32_t k = 0; k < state.old.count && error == 0; k++) {
+    if (state.old.functions[k].partner != UINT32_MAX) continue;
+    removed++;
+    error = write_function_diff(&state, &state.old.functions[k], NULL, &target);
+  }
+  if (error == 0) {
+    // The diff itself may be on stdout
+    fprintf(stderr, "%u functions compared, %u changed, %u added, %u removed\n", compared, modified, added, removed);
+    *changed = modified + added + removed > 0;
+  }
+
+  counted_free(state.out.data);
+  counted_free(state.edits);
+  free_function_body(&state.old_body);
+  free_function_body(&state.new_body);
+  close_elf(&state.old.elf);
+  close_elf(&state.new.elf);
+  return error;
+}
+
+// One input of a --batch run and how it went
+typedef struct {
+  char *path;
+  char *output;
+  int   error;
+  int   cache_result;
+  char  message[ERROR_MESSAGE_SIZE];
+} batch_item;
+
+typedef struct {
+  pthread_mutex_t lock;
+  batch_item     *items;
+  uint32_t        count;
+  uint32_t        next;
+} batch_queue;
+
+const char *base_name(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+int compare_paths(const void *a, const void *b) {
+  return strcmp(((const batch_item *) a)->path, ((const batch_item *) b)->path);
+}
+
+int compare_base_names(const void *a, const void *b) {
+  return strcmp(base_name(*(char * const *) a), base_name(*(char * const *) b));
+}
+
+int add_batch_item(batch_item **items, uint32_t *count, uint32_t *capacity, char *path) {
+  if (*count == *capacity) {
+    uint32_t grown_capacity = *capacity ? *capacity * 2 : 64;
+    batch_item *grown = counted_realloc(*items, grown_capacity * sizeof(batch_item));
+    if (!grown) {
+      counted_free(path);
+      return 0xa110c;
+    }
+    *items = grown;
+    *capacity = grown_capacity;
+  }
+  batch_item *item = &(*items)[(*count)++];
+  memset(item, 0, sizeof(batch_item));
+  item->path = path;
+  return 0;
+}
+
+void free_batch_items(batch_item *items, uint32_t count) {
+  for (uint32_t k = 0; k < count; k++) {
+    counted_free(items[k].path);
+    counted_free(items[k].output);
+  }
+  counted_free(items);
+}
+
+// Inputs of a batch: the regular files of a directory in name order, or the
+// lines of a list file in the order given
+int list_batch_inputs(const char *source, batch_item **items, uint32_t *count) {
+  uint32_t capacity = 0;
+  int error = 0;
+  *items = NULL;
+  *count = 0;
+  DIR *directory = opendir(source);
+  if (directory) {
+    struct dirent *entry;
+    while (error == 0 && (entry = readdir(directory))) {
+      if (entry->d_name[0] == '.') continue;
+      char *path = counted_malloc(strlen(source) + strlen(entry->d_name) + 2);
+      if (!path) {
+        error = 0xa110c;
+        break;
+      }
+      sprintf(path, "%s/%s", source, entry->d_name);
+      struct stat info;
+      if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+        counted_free(path);
+        continue;
+      }
+      error = add_batch_item(items, count, &capacity, path);
+    }
+    closedir(directory);
+    if (error == 0) qsort(*items, *count, sizeof(batch_item), compare_paths);
+  } else {
+    FILE *list = fopen(source, "r");
+    if (!list) {
+      report_error("Batch list is unreachable");
+      return 0x1f;
+    }
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    while (error == 0 && (length = getline(&line, &line_capacity, list)) >= 0) {
+      while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = 0;
+      if (length == 0) continue;
+      char *path = counted_strdup(line);
+      error = path ? add_batch_item(items, count, &capacity, path) : 0xa110c;
+    }
+    counted_free(line);
+    fclose(list);
+  }
+  if (error != 0) report_error("Not enough memory for the batch list");
+  return error;
+}
+
+// Outputs are named after the inputs, so two inputs with the same file name
+// would overwrite each other's output
+int check_batch_names(batch_item *items, uint32_t count) {
+  char **paths = counted_malloc(count * sizeof(char *) + 1);
+  if (!paths) {
+    report_error("Not enough memory for the batch list");
+    return 0xa110c;
+  }
+  for (uint32_t k = 0; k < count; k++) paths[k] = items[k].path;
+  qsort(paths, count, sizeof(char *), compare_base_names);
+  int error = 0;
+  for (uint32_t k = 1; k < count && error == 0; k++) {
+    if (!strcmp(base_name(paths[k - 1]), base_name(paths[k]))) {
+      report_error("%s and %s would have the same output file", paths[k - 1], paths[k]);
+      error = 0xd0b1e;
+    }
+  }
+  counted_free(paths);
+  return error;
+}
+
+void process_batch_item(batch_item *item, arena *memory) {
+  // Any message about this file lands in its item instead of on stdout
+  error_message = item->message;
+  FILE *file = fopen(item->path, "rb");
+  if (!file) {
+    report_error("Input file is unreachable");
+    item->error = 0x1f;
+    return;
+  }
+  int fd = open(item->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    report_error("Output file could not be created");
+    item->error = 0xf111;
+  } else {
+    // Files are the unit of parallelism here, each one is disassembled on a single job
+    if (options.raw) {
+      item->error = disassemble_stream(file, options.base, options.rvc, fd, memory);
+    } else {
+      item->error = disassemble_file(file, fd, 1, &item->cache_result, memory);
+    }
+    arena_reset(memory);
+    if (close(fd) != 0 && item->error == 0) {
+      report_error("Output file could not be written");
+      item->error = 0xf111;
+    }
+    // A failed file leaves no output behind rather than a truncated one
+    if (item->error != 0) unlink(item->output);
+  }
+  fclose(file);
+}
+
+// Each worker keeps one arena for all of its files
+void *batch_worker(void *argument) {
+  batch_queue *queue = argument;
+  arena memory = {0};
+  for (;;) {
+    pthread_mutex_lock(&queue->lock);
+    uint32_t k = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (k >= queue->count) break;
+    process_batch_item(&queue->items[k], &memory);
+  }
+  arena_release(&memory);
+  error_message = NULL;
+  return NULL;
+}
+
+// Disassembles every input of `source` into `out_dir`/<input file name>.txt (or .bin) on
+// `jobs` threads. A file that fails is reported and skipped, the rest of the
+// batch still runs; the result is non-zero if any file failed.
+int disassemble_batch(const char *source, const char *out_dir, int jobs) {
+  batch_queue queue = {.lock = PTHREAD_MUTEX_INITIALIZER};
+  int error = list_batch_inputs(source, &queue.items, &queue.count);
+  if (error == 0) error = check_batch_names(queue.items, queue.count);
+  if (error == 0 && mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+    report_error("Output directory could not be created");
+    error = 0xd1f;
+  }
+  for (uint32_t k = 0; k < queue.count && error == 0; k++) {
+    const char *name = base_name(queue.items[k].path);
+    queue.items[k].output = counted_malloc(strlen(out_dir) + strlen(name) + 6);
+    if (!queue.items[k].output) {
+      report_error("Not enough memory for the batch list");
+      error = 0xa110c;
+      break;
+    }
+    const char *extension = options.histogram ? (options.histogram_json ? "json" : "csv") : options.binary ? "bin" : "txt";
+    sprintf(queue.items[k].output, "%s/%s.%s", out_dir, name, extension);
+  }
+  if (error != 0) {
+    free_batch_items(queue.items, queue.count);
+    return error;
+  }
+
+  if (jobs > (int) queue.count) jobs = queue.count;
+  pthread_t *workers = counted_malloc((jobs > 1 ? jobs : 1) * sizeof(pthread_t));
+  int started = 0;
+  while (workers && started < jobs && pthread_create(&workers[started], NULL, batch_worker, &queue) == 0) started++;
+  // Without any worker thread the batch simply runs here
+  if (started == 0) batch_worker(&queue);
+  for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+  counted_free(workers);
+  pthread_mutex_destroy(&queue.lock);
+
+  uint32_t failed = 0;
+  uint32_t cached = 0;
+  for (uint32_t k = 0; k < queue.count; k++) {
+    if (queue.items[k].cache_result == CACHE_HIT) cached++;
+    if (queue.items[k].error == 0) continue;
+    printf("%s: %s (error 0x%x)\n", queue.items[k].path, queue.items[k].message, queue.items[k].error);
+    failed++;
+  }
+  printf("%u of %u files disassembled", queue.count - failed, queue.count);
+  if (options.cache) printf(", %u from the cache", cached);
+  printf("\n");
+  free_batch_items(queue.items, queue.count);
+  return failed == 0 ? 0 : 0xba7c;
+}
+
+// --serve: a resident process that answers disassembly requests on a Unix
+// domain socket, for tools that ask about the same few images over and over.
+// Parsed images (the mapping, .text, the symbols and the label index) stay in
+// a least recently used list bounded by --serve-size, keyed by the path and by
+// the device, inode, size and mtime of the file, so a rebuilt file is parsed
+// again. A request is one line "<query> <path>", the query being "all",
+// "symbol=NAME", "range=START-END" or "address=ADDR"; the reply is a line "ok"
+// followed by the output, or a line "error 0x<code> <message>". Every client
+// gets a thread of its own, so one that is slow to send its request does not
+// hold up the others. Requests use the --jobs, --rvc, --annotate and --format
+// the server was started with.
+typedef struct served_image {
+  struct served_image *newer;
+  struct served_image *older;
+  char                *path;
+  struct stat          info;      // of the file when it was parsed
+  elf_input            elf;
+  arena                memory;    // the label index, and the image of a file that could not be mapped
+  uint64_t             cost;      // bytes counted against --serve-size
+  uint32_t             users;     // requests that are formatting from it
+  int                  dropped;   // out of the list, freed by its last user
+} served_image;
+
+// A connection and the arena of its request. Finished ones are kept for the
+// next connections, so that a warm request reuses the memory of earlier ones.
+typedef struct served_client {
+  struct served_client *next;
+  struct image_cache   *cache;
+  int                   fd;
+  arena                 memory;
+} served_client;
+
+typedef struct image_cache {
+  served_image   *newest;
+  served_image   *oldest;
+  uint64_t        total;
+  uint64_t        limit;
+  uint32_t        requests;
+  uint32_t        parsed;
+  pthread_mutex_t lock;       // of all the fields
+  pthread_cond_t  finished;   // signalled when a client is done
+  served_client  *idle;
+  uint32_t        active;     // clients being served
+} image_cache;
+
+// Longest request line: a path and the query in front of it
+#define REQUEST_SIZE (PATH_MAX + 64)
+
+// Seconds a client may take to send its request or to read the reply
+#define CLIENT_TIMEOUT 10
+
+void unlink_image(image_cache *cache, served_image *image) {
+  if (image->newer) image->newer->older = image->older; else cache->newest = image->older;
+  if (image->older) image->older->newer = image->newer; else cache->oldest = image->newer;
+  image->newer = NULL;
+  image->older = NULL;
+}
+
+void push_image(image_cache *cache, served_image *image) {
+  image->older = cache->newest;
+  if (cache->newest) cache->newest->newer = image; else cache->oldest = image;
+  cache->newest = image;
+}
+
+void free_image(served_image *image) {
+  close_elf(&image->elf);
+  arena_release(&image->memory);
+  counted_free(image->path);
+  counted_free(image);
+}
+
+// Takes `image` out of the list; one that is still in use is freed by return_image()
+void drop_image(image_cache *cache, served_image *image) {
+  unlink_image(cache, image);
+  cache->total -= image->cost;
+  image->dropped = true;
+  if (image->users == 0) free_image(image);
+}
+
+void return_image(image_cache *cache, served_image *image) {
+  pthread_mutex_lock(&cache->lock);
+  if (--image->users == 0 && image->dropped) free_image(image);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+int same_file(const struct stat *a, const struct stat *b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+         a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// The parsed image of `path`, parsed now when it is not in the cache or the
+// file changed since. The newest image is kept even when it alone is over the
+// limit. Returns NULL with *error set when the file cannot be parsed, and an
+// image to give back with return_image() otherwise. The lock is not held
+// while a file is parsed, so cached images are served in the meantime.
+served_image *find_image(image_cache *cache, const char *path, int *error) {
+  FILE *file = fopen(path, "rb");
+  struct stat info;
+  if (!file || fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode)) {
+    if (file) fclose(file);
+    report_error("Input file is unreachable");
+    *error = 0x1f;
+    return NULL;
+  }
+  // A handful of images is the expected use, a list is enough to find them
+  pthread_mutex_lock(&cache->lock);
+  for (served_image *image = cache->newest; image; image = image->older) {
+    if (strcmp(image->path, path) != 0) continue;
+    if (same_file(&image->info, &info)) {
+      unlink_image(cache, image);
+      push_image(cache, image);
+      image->users++;
+      pthread_mutex_unlock(&cache->lock);
+      fclose(file);
+      return image;
+    }
+    drop_image(cache, image);
+    break;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  served_image *image = counted_calloc(1, sizeof(served_image));
+  char *copy = counted_strdup(path);
+  *error = image && copy ? open_elf(&image->elf, file, &image->memory) : 0xa110c;
+  fclose(file);
+  if (*error != 0) {
+    if (*error == 0xa110c) report_error("Not enough memory for the image");
+    if (image) arena_release(&image->memory);
+    counted_free(image);
+    counted_free(copy);
+    return NULL;
+  }
+  image->path = copy;
+  image->info = info;
+  image->cost = (image->elf.image.mapped ? image->elf.image.size : 0) + arena_size(&image->memory);
+  image->users = 1;
+  pthread_mutex_lock(&cache->lock);
+  // Another request may have parsed the same file meanwhile
+  for (served_image *other = cache->newest; other; other = other->older) {
+    if (strcmp(other->path, path) == 0) {
+      drop_image(cache, other);
+      break;
+    }
+  }
+  push_image(cache, image);
+  cache->total += image->cost;
+  cache->parsed++;
+  while (cache->total > cache->limit && cache->oldest != image) drop_image(cache, cache->oldest);
+  pthread_mutex_unlock(&cache->lock);
+  return image;
+}
+
+// Reads the request line of `client` into `line` without its newline. Returns
+// 0 on success, 1 when the client hung up without a word (as the check for a
+// running server in serve() does) and -1 on anything else.
+int read_request(int client, char *line, size_t size) {
+  size_t length = 0;
+  while (length < size) {
+    ssize_t count = read(client, line + length, size - length);
+    if (count < 0 && errno == EINTR) continue;
+    if (count == 0 && length == 0) return 1;
+    if (count <= 0) return -1;
+    char *end = memchr(line + length, '\n', count);
+    length += count;
+    if (end) {
+      *end = 0;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Fills `query` from the query in `request`; the path follows the first space
+char *parse_request(char *request, range_query *query) {
+  *query = (range_query) {0};
+  char *path = strchr(request, ' ');
+  if (!path) return NULL;
+  *path++ = 0;
+  if (!strncmp(request, "symbol=", 7) && request[7]) {
+    query->symbol = request + 7;
+  } else if (!strncmp(request, "range=", 6)) {
+    query->ranged = parse_range(request + 6, &query->range_start, &query->range_end);
+    if (!query->ranged) return NULL;
+  } else if (!strncmp(request, "address=", 8)) {
+    query->addressed = parse_address(request + 8, &query->address);
+    if (!query->addressed) return NULL;
+  } else if (strcmp(request, "all") != 0) {
+    return NULL;
+  }
+  return *path ? path : NULL;
+}
+
+// Answers one request. The reply is written straight to the socket; a failure
+// after the "ok" line (a client that went away) only cuts the output short.
+void serve_request(image_cache *cache, int client, arena *memory) {
+  char request[REQUEST_SIZE];
+  char message[ERROR_MESSAGE_SIZE] = "";
+  error_message = message;
+  int error = 0;
+  char *path = NULL;
+  range_query query;
+  int result = read_request(client, request, sizeof(request));
+  if (result > 0) {
+    error_message = NULL;
+    return;
+  }
+  if (result != 0) {
+    report_error("Request could not be read");
+    error = 0x4ead;
+  } else if (!(path = parse_request(request, &query))) {
+    report_error("Request is not understood");
+    error = 0xbad;
+  }
+  served_image *image = error == 0 ? find_image(cache, path, &error) : NULL;
+
+  // The query narrows a copy of the cached view, and local labels go to the request's arena
+  elf_input elf;
+  if (image) elf = image->elf;
+  if (error == 0 && (query.symbol || query.ranged || query.addressed)) {
+    error = select_range(&query, &elf.code, &elf.labels, elf.symbols, elf.symbols_count, elf.strtab, elf.strtab_size);
+  }
+  if (error == 0 && options.annotate && !options.binary) error = add_local_labels(&elf.labels, &elf.code, memory);
+  if (error != 0) {
+    dprintf(client, "error 0x%x %s\n", error, message);
+  } else if (write_bytes(client, "ok\n", 3) == 0) {
+    output_target target = {client, -1};
+    error = disassemble_section(&elf.code, &elf.labels, options.jobs, &target, memory);
+  }
+  if (image) return_image(cache, image);
+  if (error != 0) fprintf(stderr, "%s: %s (error 0x%x)\n", path ? path : "request", message, error);
+  __atomic_fetch_add(&cache->requests, 1, __ATOMIC_RELAXED);
+  arena_reset(memory);
+  error_message = NULL;
+}
+
+volatile sig_atomic_t serve_stopping;
+// Written by stop_serving() and polled with the listener, so that a signal just
+// before poll() still wakes the server
+int serve_wakeup[2] = {-1, -1};
+
+void *serve_client(void *argument) {
+  served_client *client = argument;
+  image_cache *cache = client->cache;
+  struct timeval timeout = {CLIENT_TIMEOUT, 0};
+  setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  serve_request(cache, client->fd, &client->memory);
+  close(client->fd);
+  pthread_mutex_lock(&cache->lock);
+  client->next = cache->idle;
+  cache->idle = client;
+  cache->active--;
+  pthread_cond_signal(&cache->finished);
+  pthread_mutex_unlock(&cache->lock);
+  return NULL;
+}
+
+void stop_serving(int signal_number) {
+  (void) signal_number;
+  int saved_errno = errno;
+  serve_stopping = true;
+  // Fails only when the pipe is full, and then a wakeup is pending already
+  ssize_t written = write(serve_wakeup[1], "", 1);
+  (void) written;
+  errno = saved_errno;
+}
+
+// Answers requests on `socket_path` until SIGINT or SIGTERM, then removes the socket
+int serve(const char *socket_path, uint64_t limit) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    report_error("Socket path is too long");
+    return 0x50c;
+  }
+  strcpy(address.sun_path, socket_path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    report_error("Socket could not be created");
+    return 0x50c;
+  }
+  // A socket left behind by a server that did not stop cleanly is replaced, one that still answers is not
+  struct stat info;
+  if (lstat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+    if (connect(listener, (struct sockaddr *) &address, sizeof(address)) == 0) {
+      close(listener);
+      report_error("Another server is listening on %s", socket_path);
+      return 0x50c;
+    }
+    unlink(socket_path);
+  }
+  if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 64) != 0 ||
+      pipe(serve_wakeup) != 0) {
+    close(listener);
+    report_error("Socket could not be created");
+    return 0x50c;
+  }
+  // Non-blocking, so that a client that goes away between poll() and accept() does not block the loop
+  fcntl(listener, F_SETFL, O_NONBLOCK);
+  fcntl(serve_wakeup[0], F_SETFL, O_NONBLOCK);
+  fcntl(serve_wakeup[1], F_SETFL, O_NONBLOCK);
+
+  struct sigaction stop = {.sa_handler = stop_serving};
+  sigaction(SIGINT, &stop, NULL);
+  sigaction(SIGTERM, &stop, NULL);
+  // A client that hangs up early must not take the server down
+  signal(SIGPIPE, SIG_IGN);
+
+  image_cache cache = {.limit = limit};
+  pthread_mutex_init(&cache.lock, NULL);
+  pthread_cond_init(&cache.finished, NULL);
+  // The signals stay with this thread, the client threads block them
+  sigset_t signals, previous;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_attr_t detached;
+  pthread_attr_init(&detached);
+  pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+  while (!serve_stopping) {
+    struct pollfd waiting[2] = {{.fd = listener, .events = POLLIN}, {.fd = serve_wakeup[0], .events = POLLIN}};
+    if (poll(waiting, 2, -1) < 0 && errno != EINTR) {
+      report_error("Socket could not accept a connection");
+      break;
+    }
+    if (!(waiting[0].revents & POLLIN)) continue;
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+      report_error("Socket could not accept a connection");
+      break;
+    }
+    pthread_mutex_lock(&cache.lock);
+    served_client *client = cache.idle;
+    if (client) cache.idle = client->next;
+    pthread_mutex_unlock(&cache.lock);
+    if (!client) client = counted_calloc(1, sizeof(served_client));
+    if (!client) {
+      close(fd);
+      continue;
+    }
+    client->cache = &cache;
+    client->fd = fd;
+    pthread_mutex_lock(&cache.lock);
+    cache.active++;
+    pthread_mutex_unlock(&cache.lock);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    pthread_t thread;
+    int created = pthread_create(&thread, &detached, serve_client, client) == 0;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (!created) {
+      close(fd);
+      pthread_mutex_lock(&cache.lock);
+      client->next = cache.idle;
+      cache.idle = client;
+      cache.active--;
+      pthread_mutex_unlock(&cache.lock);
+    }
+  }
+  close(listener);
+  unlink(socket_path);
+  close(serve_wakeup[0]);
+  close(serve_wakeup[1]);
+  // Clients in progress finish, at the latest after CLIENT_TIMEOUT
+  pthread_mutex_lock(&cache.lock);
+  while (cache.active > 0) pthread_cond_wait(&cache.finished, &cache.lock);
+  pthread_mutex_unlock(&cache.lock);
+  fprintf(stderr, "%u requests, %u images parsed\n", cache.requests, cache.parsed);
+  while (cache.newest) drop_image(&cache, cache.newest);
+  while (cache.idle) {
+    served_client *next = cache.idle->next;
+    arena_release(&cache.idle->memory);
+    counted_free(cache.idle);
+    cache.idle = next;
+  }
+  pthread_attr_destroy(&detached);
+  pthread_mutex_destroy(&cache.lock);
+  pthread_cond_destroy(&cache.finished);
+  return serve_stopping ? 0 : 0x50c;
+}
+
+// --connect: asks the server on `socket_path` for the output about `input_path`
+// and writes it to `fd`, so that it reads as if this process had made it
+int query_server(const char *socket_path, const char *input_path, int fd) {
+  char path[PATH_MAX];
+  if (!realpath(input_path, path)) {
+    report_error("Input file is unreachable");
+    return 0x1f;
+  }
+  char request[REQUEST_SIZE];
+  if (options.query.symbol) {
+    snprintf(request, sizeof(request), "symbol=%s %s\n", options.query.symbol, path);
+  } else if (options.query.ranged) {
+    snprintf(request, sizeof(request), "range=0x%x-0x%x %s\n", options.query.range_start, options.query.range_end, path);
+  } else if (options.query.addressed) {
+    snprintf(request, sizeof(request), "address=0x%x %s\n", options.query.address, path);
+  } else {
+    snprintf(request, sizeof(request), "all %s\n", path);
+  }
+
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  int server = strlen(socket_path) < sizeof(address.sun_path) ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+  if (server >= 0) strcpy(address.sun_path, socket_path);
+  if (server < 0 || connect(server, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+      write_bytes(server, request, strlen(request)) != 0) {
+    if (server >= 0) close(server);
+    report_error("Server is unreachable");
+    return 0x50c;
+  }
+
+  // The status line, then the output as it comes
+  char buffer[1 << 16];
+  size_t length = 0;
+  char *end = NULL;
+  while (!end && length < ERROR_MESSAGE_SIZE + 32) {
+    ssize_t count = read(server, buffer + length, sizeof(buffer) - length);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) break;
+    end = memchr(buffer + length, '\n', count);
+    length += count;
+  }
+  int error = 0;
+  unsigned code;
+  int message = 0;
+  if (end && !strncmp(buffer, "ok\n", 3)) {
+    size_t start = end + 1 - buffer;
+    error = write_bytes(fd, buffer + start, length - start);
+    ssize_t count;
+    while (error == 0 && ((count = read(server, buffer, sizeof(buffer))) > 0 || (count < 0 && errno == EINTR))) {
+      if (count > 0) error = write_bytes(fd, buffer, count);
+    }
+    if (error != 0) {
+      report_error("Output file could not be written");
+      error = 0xf111;
+    }
+  } else if (end && sscanf(buffer, "error 0x%x %n", &code, &message) == 1 && message > 0 && code != 0) {
+    *end = 0;
+    report_error("%s", message <= end - buffer ? buffer + message : "");
+    error = code;
+  } else {
+    report_error("Server reply is not understood");
+    error = 0x50c;
+  }
+  close(server);
+  return error;
+}
+
+// Prints the --stats report to stderr, `wall_ns` being the whole run
+void print_stats(uint64_t wall_ns) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  uint64_t cpu_ns = (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 +
+                    (uint64_t) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+  double per_second = wall_ns ? stats.instructions * 1e9 / wall_ns : 0;
+  // ru_maxrss is in KiB on Linux
+  long peak_rss = usage.ru_maxrss;
+
+  if (options.stats_json) {
+    fprintf(stderr, "{\"phases\": {");
+    for (int k = 0; k < PHASE_COUNT; k++) {
+      fprintf(stderr, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", k ? ", " : "", phase_names[k],
+              stats.wall_ns[k] / 1e6, stats.cpu_ns[k] / 1e6);
+    }
+    fprintf(stderr, "}, \"total\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}, ", wall_ns / 1e6, cpu_ns / 1e6);
+    fprintf(stderr, "\"instructions\": %llu, \"text_bytes\": %llu, \"output_bytes\": %llu, "
+            "\"instructions_per_second\": %.0f, \"peak_rss_kib\": %ld",
+            (unsigned long long) stats.instructions, (unsigned long long) stats.text_bytes,
+            (unsigned long long) stats.output_bytes, per_second, peak_rss);
+    fprintf(stderr, ", \"allocations\": %llu, \"reallocations\": %llu, \"frees\": %llu",
+            (unsigned long long) stats.allocations, (unsigned long long) stats.reallocations,
+            (unsigned long long) stats.frees);
+    fprintf(stderr, "}\n");
+    return;
+  }
+
+  fprintf(stderr, "%-12s %12s %12s\n", "phase", "wall ms", "cpu ms");
+  for (int k = 0; k < PHASE_COUNT; k++) {
+    fprintf(stderr, "%-12s %12.3f %12.3f\n", phase_names[k], stats.wall_ns[k] / 1e6, stats.cpu_ns[k] / 1e6);
+  }
+  fprintf(stderr, "%-12s %12.3f %12.3f\n", "total", wall_ns / 1e6, cpu_ns / 1e6);
+  fprintf(stderr, "instructions %llu, .text bytes %llu, output bytes %llu\n", (unsigned long long) stats.instructions,
+          (unsigned long long) stats.text_bytes, (unsigned long long) stats.output_bytes);
+  fprintf(stderr, "throughput   %.1f M instructions/s\n", per_second / 1e6);
+  fprintf(stderr, "peak RSS     %ld KiB\n", peak_rss);
+  fprintf(stderr, "allocations  %llu, reallocations %llu, frees %llu\n", (unsigned long long) stats.allocations,
+          (unsigned long long) stats.reallocations, (unsigned long long) stats.frees);
+}
+
+int main(int argc, char **argv) {
+  uint64_t started = clock_ns(CLOCK_MONOTONIC);
+  if (open_files(argc, argv) != 0){
+     close_files();
+     return options.diff ? 2 : 1;
+  }
+  int error;
+  int cache_result = CACHE_OFF;
+  int changed = false;
+  arena memory = {0};
+  if (options.diff) {
+     error = disassemble_diff(input, options.diff_paths[0], second_input, options.diff_paths[1], fileno(stdout),
+                              &changed, &memory);
+  } else if (options.batch) {
+     error = disassemble_batch(options.batch, options.out_dir, options.jobs);
+  } else if (options.trace) {
+     error = disassemble_trace(input, trace_input, fileno(stdout), &memory);
+  } else if (options.serve) {
+     error = serve(options.serve, options.serve_size);
+  } else if (options.connect) {
+     error = query_server(options.connect, options.input_path, fileno(stdout));
+  } else if (options.raw) {
+     error = disassemble_stream(input, options.base, options.rvc, fileno(stdout), &memory);
+  } else {
+     error = disassemble_file(input, fileno(stdout), options.jobs, &cache_result, &memory);
+  }
+  arena_release(&memory);
+  // Hits and misses go to stderr, stdout may be the disassembly itself
+  if (cache_result != CACHE_OFF) fprintf(stderr, "cache %s\n", cache_result == CACHE_HIT ? "hit" : "miss");
+  if (options.cache) evict_cache(options.cache, options.cache_size);
+  close_files();
+  if (options.stats) print_stats(clock_ns(CLOCK_MONOTONIC) - started);
+  // --diff exits like diff(1): 0 for no differences, 1 for some, 2 for trouble
+  if (options.diff) return error != 0 ? 2 : changed;
+  return error == 0 ? 0 : 1;
+}
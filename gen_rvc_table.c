@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "decoder.h"
+
+// Build-time generator for rvc_table.inc: one row per 16-bit parcel holding
+// the command and operands of the 32-bit instruction it expands to, so that
+// decoding a compressed instruction at run time is a single table load.
+// Parcels that are reserved, floating point or not compressed at all get
+// UNKNOWN. Run as `gen_rvc_table > rvc_table.inc`.
+
+#define EXPANDS_TO_NOTHING 0
+
+uint32_t encode_r(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t funct7) {
+  return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+uint32_t encode_i(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, int32_t imm) {
+  return (uint32_t) imm << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+uint32_t encode_s(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+  return get_slice(imm, 11, 5) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | get_slice(imm, 4, 0) << 7 | opcode;
+}
+
+uint32_t encode_b(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+  return get_slice(imm, 12, 12) << 31 | get_slice(imm, 10, 5) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 |
+         get_slice(imm, 4, 1) << 8 | get_slice(imm, 11, 11) << 7 | 0b1100011;
+}
+
+uint32_t encode_u(uint32_t opcode, uint32_t rd, int32_t imm) {
+  return ((uint32_t) imm & 0xfffff000) | rd << 7 | opcode;
+}
+
+uint32_t encode_j(uint32_t rd, int32_t imm) {
+  return get_slice(imm, 20, 20) << 31 | get_slice(imm, 10, 1) << 21 | get_slice(imm, 11, 11) << 20 |
+         get_slice(imm, 19, 12) << 12 | rd << 7 | 0b1101111;
+}
+
+int32_t sign_extend_bits(uint32_t value, int bits) {
+  return (int32_t) (value << (32 - bits)) >> (32 - bits);
+}
+
+// The 32-bit instruction a RV32C parcel stands for, or EXPANDS_TO_NOTHING
+uint32_t expand_compressed(uint16_t c) {
+  uint32_t funct3  = get_slice(c, 15, 13);
+  uint32_t rd      = get_slice(c, 11, 7);                      // rd / rs1 of CR, CI and CSS formats
+  uint32_t rs2     = get_slice(c, 6, 2);
+  uint32_t rd_p    = get_slice(c, 4, 2) + 8;                   // rd' / rs2' of CIW, CL, CS and CA formats
+  uint32_t rs1_p   = get_slice(c, 9, 7) + 8;                   // rs1' / rd' of CL, CS, CA and CB formats
+  int32_t  imm6    = sign_extend_bits(get_slice(c, 12, 12) << 5 | get_slice(c, 6, 2), 6);
+  uint32_t shamt   = get_slice(c, 12, 12) << 5 | get_slice(c, 6, 2);
+  uint32_t lw_imm  = get_slice(c, 5, 5) << 6 | get_slice(c, 12, 10) << 3 | get_slice(c, 6, 6) << 2;
+  int32_t  j_imm   = sign_extend_bits(get_slice(c, 12, 12) << 11 | get_slice(c, 8, 8) << 10 | get_slice(c, 10, 9) << 8 |
+                                      get_slice(c, 6, 6) << 7 | get_slice(c, 7, 7) << 6 | get_slice(c, 2, 2) << 5 |
+                                      get_slice(c, 11, 11) << 4 | get_slice(c, 5, 3) << 1, 12);
+  int32_t  b_imm   = sign_extend_bits(get_slice(c, 12, 12) << 8 | get_slice(c, 6, 5) << 6 | get_slice(c, 2, 2) << 5 |
+                                      get_slice(c, 11, 10) << 3 | get_slice(c, 4, 3) << 1, 9);
+
+  switch (get_slice(c, 1, 0) << 3 | funct3) {
+    // Quadrant 0
+    case 0b00000: {                                                                  // c.addi4spn
+      uint32_t imm = get_slice(c, 10, 7) << 6 | get_slice(c, 12, 11) << 4 | get_slice(c, 5, 5) << 3 | get_slice(c, 6, 6) << 2;
+      if (imm == 0) return EXPANDS_TO_NOTHING;
+      return encode_i(0b0010011, rd_p, 0b000, 2, imm);
+    }
+    case 0b00010:                                                                    // c.lw
+      return encode_i(0b0000011, rd_p, 0b010, rs1_p, lw_imm);
+    case 0b00110:                                                                    // c.sw
+      return encode_s(0b0100011, 0b010, rs1_p, rd_p, lw_imm);
+
+    // Quadrant 1
+    case 0b01000:                                                                    // c.nop, c.addi
+      return encode_i(0b0010011, rd, 0b000, rd, imm6);
+    case 0b01001:                                                                    // c.jal
+      return encode_j(1, j_imm);
+    case 0b01010:                                                                    // c.li
+      return encode_i(0b0010011, rd, 0b000, 0, imm6);
+    case 0b01011:
+      if (rd == 2) {                                                                 // c.addi16sp
+        int32_t imm = sign_extend_bits(get_slice(c, 12, 12) << 9 | get_slice(c, 4, 3) << 7 | get_slice(c, 5, 5) << 6 |
+                                       get_slice(c, 2, 2) << 5 | get_slice(c, 6, 6) << 4, 10);
+        if (imm == 0) return EXPANDS_TO_NOTHING;
+        return encode_i(0b0010011, 2, 0b000, 2, imm);
+      }
+      if (imm6 == 0) return EXPANDS_TO_NOTHING;                                      // c.lui
+      return encode_u(0b0110111, rd, (uint32_t) imm6 << 12);
+    case 0b01100:
+      switch (get_slice(c, 11, 10)) {
+        case 0b00:                                                                   // c.srli
+          if (shamt >= 32) return EXPANDS_TO_NOTHING;
+          return encode_i(0b0010011, rs1_p, 0b101, rs1_p, shamt);
+        case 0b01:                                                                   // c.srai
+          if (shamt >= 32) return EXPANDS_TO_NOTHING;
+          return encode_i(0b0010011, rs1_p, 0b101, rs1_p, 0b0100000 << 5 | shamt);
+        case 0b10:                                                                   // c.andi
+          return encode_i(0b0010011, rs1_p, 0b111, rs1_p, imm6);
+        default:
+          if (get_slice(c, 12, 12)) return EXPANDS_TO_NOTHING;                        // c.subw and c.addw are RV64 only
+          switch (get_slice(c, 6, 5)) {
+            case 0b00: return encode_r(0b0110011, rs1_p, 0b000, rs1_p, rd_p, 0b0100000);   // c.sub
+            case 0b01: return encode_r(0b0110011, rs1_p, 0b100, rs1_p, rd_p, 0b0000000);   // c.xor
+            case 0b10: return encode_r(0b0110011, rs1_p, 0b110, rs1_p, rd_p, 0b0000000);   // c.or
+            default:   return encode_r(0b0110011, rs1_p, 0b111, rs1_p, rd_p, 0b0000000);   // c.and
+          }
+      }
+    case 0b01101:                                                                    // c.j
+      return encode_j(0, j_imm);
+    case 0b01110:                                                                    // c.beqz
+      return encode_b(0b000, rs1_p, 0, b_imm);
+    case 0b01111:                                                                    // c.bnez
+      return encode_b(0b001, rs1_p, 0, b_imm);
+
+    // Quadrant 2
+    case 0b10000:                                                                    // c.slli
+      if (shamt >= 32) return EXPANDS_TO_NOTHING;
+      return encode_i(0b0010011, rd, 0b001, rd, shamt);
+    case 0b10010: {                                                                  // c.lwsp
+      uint32_t imm = get_slice(c, 3, 2) << 6 | get_slice(c, 12, 12) << 5 | get_slice(c, 6, 4) << 2;
+      if (rd == 0) return EXPANDS_TO_NOTHING;
+      return encode_i(0b0000011, rd, 0b010, 2, imm);
+    }
+    case 0b10100:
+      if (!get_slice(c, 12, 12)) {
+        if (rs2 == 0) {                                                              // c.jr
+          if (rd == 0) return EXPANDS_TO_NOTHING;
+          return encode_i(0b1100111, 0, 0b000, rd, 0);
+        }
+        return encode_r(0b0110011, rd, 0b000, 0, rs2, 0b0000000);                   // c.mv
+      }
+      if (rd == 0 && rs2 == 0) return 0x00100073;                                    // c.ebreak
+      if (rs2 == 0) return encode_i(0b1100111, 1, 0b000, rd, 0);                     // c.jalr
+      return encode_r(0b0110011, rd, 0b000, rd, rs2, 0b0000000);                     // c.add
+    case 0b10110: {                                                                  // c.swsp
+      uint32_t imm = get_slice(c, 8, 7) << 6 | get_slice(c, 12, 9) << 2;
+      return encode_s(0b0100011, 0b010, 2, rs2, imm);
+    }
+  }
+  // c.fld, c.flw, c.fsd, c.fsw, their sp forms, the reserved slot and 32-bit parcels
+  return EXPANDS_TO_NOTHING;
+}
+
+int main(void) {
+  printf("// Generated by gen_rvc_table, do not edit\n");
+  for (uint32_t parcel = 0; parcel < 65536; parcel++) {
+    uint32_t command = expand_compressed(parcel);
+    enum Command cmd = command == EXPANDS_TO_NOTHING ? UNKNOWN : get_command(command);
+    if (cmd == UNKNOWN) {
+      printf("{%d, 0, 0, 0, 0},\n", UNKNOWN);
+      continue;
+    }
+    printf("{%d, %u, %u, %u, %d},\n", cmd, get_slice(command, 11, 7), get_slice(command, 19, 15), get_slice(command, 24, 20),
+           get_immediate(command, command_formats[cmd]));
+  }
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include "decoder.h"
+
+typedef struct {
+  uint8_t     command;
+  uint8_t     rd;
+  uint8_t     rs1;
+  uint8_t     rs2;
+  int32_t     imm;
+} rvc_entry;
+
+// Expansion of every 16-bit parcel, generated at build time by gen_rvc_table
+static const rvc_entry rvc_table[65536] = {
+#include "rvc_table.inc"
+};
+
+size_t decode_parcels(const uint16_t *parcels, size_t parcel_count, decoded_instructions *decoded, size_t *consumed) {
+  size_t count = 0;
+  size_t p = 0;
+  while (count < decoded->capacity && p < parcel_count) {
+    uint16_t parcel = parcels[p];
+    if (parcels_of(parcel) == 1) {
+      const rvc_entry *entry = &rvc_table[parcel];
+      decoded->command[count] = entry->command;
+      decoded->format[count]  = command_formats[entry->command];
+      decoded->rd[count]      = entry->rd;
+      decoded->rs1[count]     = entry->rs1;
+      decoded->rs2[count]     = entry->rs2;
+      decoded->imm[count]     = entry->imm;
+      decoded->length[count]  = 2;
+      p += 1;
+    } else {
+      if (p + 2 > parcel_count) break;
+      uint32_t command = parcels[p] | (uint32_t) parcels[p + 1] << 16;
+      enum Command cmd = get_command(command);
+      enum Format format = command_formats[cmd];
+      decoded->command[count] = cmd;
+      decoded->format[count]  = format;
+      decoded->rd[count]      = get_slice(command, 11, 7);                                  // ____ ____ ____ ____ ____ xxxx x___ ____
+      decoded->rs1[count]     = get_slice(command, 19, 15);                                 // ____ ____ ____ xxxx x___ ____ ____ ____
+      decoded->rs2[count]     = get_slice(command, 24, 20);                                 // ____ ___x xxxx ____ ____ ____ ____ ____
+      decoded->imm[count]     = get_immediate(command, format);
+      decoded->length[count]  = 4;
+      p += 2;
+    }
+    count++;
+  }
+  *consumed = p;
+  return count;
+}
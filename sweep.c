@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "decoder.h"
+
+#define true  1
+#define false 0
+
+// Exhaustive check of the 32-bit decoder: every word from 0 to 0xffffffff is
+// classified by an independent mask/match table, by get_command() and by each
+// decode_instructions() kernel the CPU can run, and any disagreement is reported.
+// The words are swept in blocks shared out to all cores. Every kernel is timed
+// on its own, so the sweep is also the worst-case throughput benchmark: most
+// words are not instructions and hit the slowest paths of the tables.
+
+// One RV32IM instruction as the ISA manual gives it: a word is `command` when
+// (word & mask) == match. The table is written out from the manual, not from
+// decoder.c. Fields the manual reserves are required to be zero, as the decoder
+// does: fm, rs1 and rd of FENCE, all of FENCE.I, and ECALL and EBREAK are whole words.
+typedef struct {
+  uint32_t     mask;
+  uint32_t     match;
+  enum Command command;
+} reference_encoding;
+
+const reference_encoding reference[] = {
+  {0x0000007f, 0x00000037, LUI},
+  {0x0000007f, 0x00000017, AUIPC},
+  {0x0000007f, 0x0000006f, JAL},
+  {0x0000707f, 0x00000067, JALR},
+  {0x0000707f, 0x00000063, BEQ},
+  {0x0000707f, 0x00001063, BNE},
+  {0x0000707f, 0x00004063, BLT},
+  {0x0000707f, 0x00005063, BGE},
+  {0x0000707f, 0x00006063, BLTU},
+  {0x0000707f, 0x00007063, BGEU},
+  {0x0000707f, 0x00000003, LB},
+  {0x0000707f, 0x00001003, LH},
+  {0x0000707f, 0x00002003, LW},
+  {0x0000707f, 0x00004003, LBU},
+  {0x0000707f, 0x00005003, LHU},
+  {0x0000707f, 0x00000023, SB},
+  {0x0000707f, 0x00001023, SH},
+  {0x0000707f, 0x00002023, SW},
+  {0x0000707f, 0x00000013, ADDI},
+  {0x0000707f, 0x00002013, SLTI},
+  {0x0000707f, 0x00003013, SLTIU},
+  {0x0000707f, 0x00004013, XORI},
+  {0x0000707f, 0x00006013, ORI},
+  {0x0000707f, 0x00007013, ANDI},
+  {0xfe00707f, 0x00001013, SLLI},
+  {0xfe00707f, 0x00005013, SRLI},
+  {0xfe00707f, 0x40005013, SRAI},
+  {0xfe00707f, 0x00000033, ADD},
+  {0xfe00707f, 0x40000033, SUB},
+  {0xfe00707f, 0x00001033, SLL},
+  {0xfe00707f, 0x00002033, SLT},
+  {0xfe00707f, 0x00003033, SLTU},
+  {0xfe00707f, 0x00004033, XOR},
+  {0xfe00707f, 0x00005033, SRL},
+  {0xfe00707f, 0x40005033, SRA},
+  {0xfe00707f, 0x00006033, OR},
+  {0xfe00707f, 0x00007033, AND},
+  {0xf00fffff, 0x0000000f, FENCE},
+  {0xffffffff, 0x0000100f, FENCE_I},
+  {0xffffffff, 0x00000073, ECALL},
+  {0xffffffff, 0x00100073, EBREAK},
+  {0x0000707f, 0x00001073, CSRRW},
+  {0x0000707f, 0x00002073, CSRRS},
+  {0x0000707f, 0x00003073, CSRRC},
+  {0x0000707f, 0x00005073, CSRRWI},
+  {0x0000707f, 0x00006073, CSRRSI},
+  {0x0000707f, 0x00007073, CSRRCI},
+  {0xfe00707f, 0x02000033, MUL},
+  {0xfe00707f, 0x02001033, MULH},
+  {0xfe00707f, 0x02002033, MULHSU},
+  {0xfe00707f, 0x02003033, MULHU},
+  {0xfe00707f, 0x02004033, DIV},
+  {0xfe00707f, 0x02005033, DIVU},
+  {0xfe00707f, 0x02006033, REM},
+  {0xfe00707f, 0x02007033, REMU},
+};
+
+#define REFERENCE_COUNT (sizeof(reference) / sizeof(reference[0]))
+
+// Every mask covers the opcode, so a word only has to be tried against the
+// entries of its own low 7 bits
+uint8_t candidates[128][REFERENCE_COUNT];
+uint8_t candidate_count[128];
+
+void index_reference(void) {
+  for (uint32_t k = 0; k < REFERENCE_COUNT; k++) {
+    uint32_t opcode = reference[k].match & 0x7f;
+    candidates[opcode][candidate_count[opcode]++] = k;
+  }
+}
+
+// The command of `word` by the table, UNKNOWN when no entry matches. More than
+// one match would be a mistake in the table itself and is counted in `overlaps`.
+static inline enum Command reference_command(uint32_t word, uint64_t *overlaps) {
+  uint32_t opcode = word & 0x7f;
+  enum Command found = UNKNOWN;
+  int matches = 0;
+  for (uint32_t k = 0; k < candidate_count[opcode]; k++) {
+    const reference_encoding *entry = &reference[candidates[opcode][k]];
+    if ((word & entry->mask) == entry->match) {
+      found = entry->command;
+      matches++;
+    }
+  }
+  if (matches > 1) (*overlaps)++;
+  return found;
+}
+
+typedef void (*decode_kernel)(const uint32_t *words, size_t count, decoded_instructions *decoded);
+
+// get_command() comes first and is timed like the kernels
+#define MAX_KERNELS 4
+
+const char   *kernel_names[MAX_KERNELS] = {"get_command"};
+decode_kernel kernels[MAX_KERNELS];
+int           kernel_count = 1;
+
+// The kernels this CPU can run, see decode_kernel_name()
+void find_kernels(void) {
+  kernel_names[kernel_count] = "scalar";
+  kernels[kernel_count++] = decode_instructions_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if (strcmp(decode_kernel_name(), "scalar")) {
+    kernel_names[kernel_count] = "sse2";
+    kernels[kernel_count++] = decode_instructions_sse2;
+  }
+  if (!strcmp(decode_kernel_name(), "avx2")) {
+    kernel_names[kernel_count] = "avx2";
+    kernels[kernel_count++] = decode_instructions_avx2;
+  }
+#endif
+}
+
+typedef struct {
+  int      jobs;
+  uint64_t first;        // first word swept
+  uint64_t count;        // number of words, up to 2^32
+} sweep_options;
+
+sweep_options options = {0, 0, 1ULL << 32};
+
+// Words per block handed to a thread
+#define SWEEP_BLOCK 65536
+
+// Mismatches printed before the rest are only counted
+#define MISMATCHES_SHOWN 20
+
+typedef struct {
+  uint64_t counts[UNKNOWN + 1];         // words per command, by the reference
+  uint64_t mismatches;
+  uint64_t overlaps;
+  uint64_t kernel_ns[MAX_KERNELS];
+} sweep_totals;
+
+typedef struct {
+  uint64_t        next_block;
+  uint64_t        block_count;
+  pthread_mutex_t lock;
+  sweep_totals    totals;
+  uint64_t        shown;
+  int             failed;         // a thread could not get its buffers
+} sweep_queue;
+
+sweep_queue queue = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static inline uint64_t clock_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void report_mismatch(const char *kernel, uint32_t word, const char *field, int64_t got, int64_t expected) {
+  pthread_mutex_lock(&queue.lock);
+  if (queue.shown++ < MISMATCHES_SHOWN && !strcmp(field, "command") && got >= 0 && got <= UNKNOWN) {
+    printf("mismatch  %-12s %08x %-8s got %s, expected %s\n", kernel, word, field, command_names[got],
+           command_names[expected]);
+  } else if (queue.shown <= MISMATCHES_SHOWN) {
+    printf("mismatch  %-12s %08x %-8s got %lld, expected %lld\n", kernel, word, field, (long long) got,
+           (long long) expected);
+  }
+  pthread_mutex_unlock(&queue.lock);
+}
+
+// Checks every field of the decoded entries against the reference command and
+// the raw word, returns the number of words that were wrong
+uint64_t check_decoded(const char *kernel, const uint32_t *words, const uint8_t *expected, size_t count,
+                       const decoded_instructions *decoded) {
+  uint64_t mismatches = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t word = words[i];
+    enum Command command = expected[i];
+    enum Format format = command_formats[command];
+    const char *field = NULL;
+    int64_t got = 0;
+    int64_t want = 0;
+    if (decoded->command[i] != command) {
+      field = "command", got = decoded->command[i], want = command;
+    } else if (decoded->format[i] != format) {
+      field = "format", got = decoded->format[i], want = format;
+    } else if (decoded->rd[i] != get_slice(word, 11, 7)) {
+      field = "rd", got = decoded->rd[i], want = get_slice(word, 11, 7);
+    } else if (decoded->rs1[i] != get_slice(word, 19, 15)) {
+      field = "rs1", got = decoded->rs1[i], want = get_slice(word, 19, 15);
+    } else if (decoded->rs2[i] != get_slice(word, 24, 20)) {
+      field = "rs2", got = decoded->rs2[i], want = get_slice(word, 24, 20);
+    } else if (decoded->imm[i] != get_immediate(word, format)) {
+      field = "imm", got = decoded->imm[i], want = get_immediate(word, format);
+    } else if (decoded->length[i] != 4) {
+      field = "length", got = decoded->length[i], want = 4;
+    }
+    if (!field) continue;
+    mismatches++;
+    report_mismatch(kernel, word, field, got, want);
+  }
+  return mismatches;
+}
+
+void *sweep_worker(void *argument) {
+  (void) argument;
+  sweep_totals totals;
+  memset(&totals, 0, sizeof(totals));
+  uint32_t *words = malloc(SWEEP_BLOCK * sizeof(uint32_t));
+  uint8_t *expected = malloc(SWEEP_BLOCK);
+  uint8_t *commands = malloc(SWEEP_BLOCK);
+  decoded_instructions decoded;
+  int allocated = alloc_decoded(&decoded, SWEEP_BLOCK) == 0;
+  if (!words || !expected || !commands || !allocated) {
+    pthread_mutex_lock(&queue.lock);
+    queue.failed = true;
+    pthread_mutex_unlock(&queue.lock);
+  }
+
+  uint64_t block;
+  while (words && expected && commands && allocated &&
+         (block = __atomic_fetch_add(&queue.next_block, 1, __ATOMIC_RELAXED)) < queue.block_count) {
+    uint64_t first = options.first + block * SWEEP_BLOCK;
+    uint64_t end = options.first + options.count;
+    size_t count = end - first < SWEEP_BLOCK ? end - first : SWEEP_BLOCK;
+    for (size_t i = 0; i < count; i++) {
+      words[i] = first + i;
+      expected[i] = reference_command(words[i], &totals.overlaps);
+      totals.counts[expected[i]]++;
+    }
+
+    uint64_t started = clock_ns();
+    for (size_t i = 0; i < count; i++) commands[i] = get_command(words[i]);
+    totals.kernel_ns[0] += clock_ns() - started;
+    for (size_t i = 0; i < count; i++) {
+      if (commands[i] == expected[i]) continue;
+      totals.mismatches++;
+      report_mismatch(kernel_names[0], words[i], "command", commands[i], expected[i]);
+    }
+
+    for (int k = 1; k < kernel_count; k++) {
+      started = clock_ns();
+      kernels[k](words, count, &decoded);
+      totals.kernel_ns[k] += clock_ns() - started;
+      totals.mismatches += check_decoded(kernel_names[k], words, expected, count, &decoded);
+    }
+  }
+
+  pthread_mutex_lock(&queue.lock);
+  for (int k = 0; k <= UNKNOWN; k++) queue.totals.counts[k] += totals.counts[k];
+  for (int k = 0; k < kernel_count; k++) queue.totals.kernel_ns[k] += totals.kernel_ns[k];
+  queue.totals.mismatches += totals.mismatches;
+  queue.totals.overlaps += totals.overlaps;
+  pthread_mutex_unlock(&queue.lock);
+
+  free(words);
+  free(expected);
+  free(commands);
+  if (allocated) free_decoded(&decoded);
+  return NULL;
+}
+
+void print_sweep_usage(char *program) {
+  printf("usage: %s [--jobs N] [--first WORD] [--count N]\n", program);
+  printf("       sweeps N words (all 2^32 by default) from WORD on N threads (one per core by default)\n");
+}
+
+int parse_sweep_options(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    char *end = "";
+    if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+      options.jobs = strtol(argv[++i], &end, 10);
+    } else if (!strcmp(argv[i], "--first") && i + 1 < argc) {
+      options.first = strtoull(argv[++i], &end, 0);
+    } else if (!strcmp(argv[i], "--count") && i + 1 < argc) {
+      options.count = strtoull(argv[++i], &end, 0);
+    } else {
+      end = "?";
+    }
+    if (*end != 0) {
+      print_sweep_usage(argv[0]);
+      return 0x5eef;
+    }
+  }
+  if (options.jobs < 0 || options.jobs > 1024 || options.count == 0 || options.first > UINT32_MAX ||
+      options.count > (1ULL << 32) - options.first) {
+    printf("--jobs must be between 0 and 1024, and the words must lie in [0, 2^32)\n");
+    return 0x5eef;
+  }
+  if (options.jobs == 0) options.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (parse_sweep_options(argc, argv) != 0) return 1;
+  index_reference();
+  find_kernels();
+
+  printf("# %llu words from %08llx, %d jobs, kernels", (unsigned long long) options.count,
+         (unsigned long long) options.first, options.jobs);
+  for (int k = 0; k < kernel_count; k++) printf(" %s", kernel_names[k]);
+  printf("\n");
+  fflush(stdout);
+
+  queue.block_count = (options.count + SWEEP_BLOCK - 1) / SWEEP_BLOCK;
+  pthread_t *threads = malloc(options.jobs * sizeof(pthread_t));
+  if (!threads) {
+    printf("Not enough memory for the threads\n");
+    return 1;
+  }
+  uint64_t started = clock_ns();
+  int started_threads = 0;
+  for (; started_threads < options.jobs; started_threads++) {
+    if (pthread_create(&threads[started_threads], NULL, sweep_worker, NULL) != 0) break;
+  }
+  // Fewer threads only make the sweep slower
+  if (started_threads == 0) sweep_worker(NULL);
+  for (int k = 0; k < started_threads; k++) pthread_join(threads[k], NULL);
+  uint64_t wall_ns = clock_ns() - started;
+  free(threads);
+  if (queue.failed) {
+    printf("Not enough memory for the sweep buffers\n");
+    return 1;
+  }
+
+  const sweep_totals *totals = &queue.totals;
+  printf("%-12s %12s\n", "command", "words");
+  for (int k = 0; k <= UNKNOWN; k++) {
+    printf("%-12s %12llu\n", command_names[k], (unsigned long long) totals->counts[k]);
+  }
+  printf("\n%-12s %12s %14s\n", "kernel", "ns/word", "M words/s");
+  for (int k = 0; k < kernel_count; k++) {
+    double per_word = (double) totals->kernel_ns[k] / options.count;
+    printf("%-12s %12.3f %14.1f\n", kernel_names[k], per_word, per_word > 0 ? 1e3 / per_word : 0);
+  }
+  printf("(per thread; the whole sweep took %.1f s, %.1f M words/s with checks on %d jobs)\n\n", wall_ns / 1e9,
+         options.count * 1e3 / wall_ns, options.jobs);
+
+  if (totals->overlaps) printf("%llu words match more than one reference entry\n", (unsigned long long) totals->overlaps);
+  printf("%llu mismatches\n", (unsigned long long) totals->mismatches);
+  return totals->mismatches == 0 && totals->overlaps == 0 ? 0 : 1;
+}